@@ -6,7 +6,10 @@ LOCAL_CFLAGS += -Wall -fPIE
 LOCAL_LDFLAGS += -fPIE -pie
 LOCAL_C_INCLUDES := bionic
 
-LOCAL_SRC_FILES := main.c pts-shell.c pts-wrap.c pts-exec.c pts-daemon.c pts-passwd.c bcrypt.c blowfish.c helpers.c
+LOCAL_SRC_FILES := main.c pts-shell.c pts-wrap.c pts-exec.c pts-daemon.c pts-passwd.c bcrypt.c blowfish.c helpers.c hashpool.c sha256.c ticket.c policy.c proto.c zygote.c ptypool.c relay.c uring.c
+
+# The Blowfish kernel is all S-box lookups, better in ARM mode
+LOCAL_SRC_FILES += eksblowfish.c.arm
 
 include $(BUILD_EXECUTABLE)
 
@@ -53,6 +53,7 @@
 #include <string.h>
 #include <pwd.h>
 #include "blf.h"
+#include "bcrypt.h"
 
 /* This implementation is adaptable to current computing power.
  * You can have up to 2^31 rounds which should be enough for some
@@ -68,16 +69,10 @@
 #   define _PASSWORD_LEN   128
 #endif
 
-char   *bcrypt_gensalt(u_int8_t);
-
 static void encode_salt(char *, u_int8_t *, u_int16_t, u_int8_t);
 static void encode_base64(u_int8_t *, u_int8_t *, u_int16_t);
 static void decode_base64(u_int8_t *, u_int16_t, u_int8_t *);
 
-static char    encrypted[_PASSWORD_LEN];
-static char    gsalt[7 + (BCRYPT_MAXSALT * 4 + 2) / 3 + 1];
-static char    error[] = ":";
-
 const static u_int8_t Base64Code[] =
 "./ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789";
 
@@ -175,12 +170,17 @@ void dev_urandom_buf(u_int8_t *buf, size_t size) {
 /* Generates a salt for this version of crypt.
    Since versions may change. Keeping this here
    seems sensible.
+   The salt is written to gsalt, which must hold at least
+   BCRYPT_SALTSPACE bytes. Returns gsalt, or NULL if it is too small.
  */
 char *
-bcrypt_gensalt(u_int8_t log_rounds)
+bcrypt_gensalt_r(u_int8_t log_rounds, char *gsalt, size_t size)
 {
 	u_int8_t csalt[BCRYPT_MAXSALT];
 
+	if (size < BCRYPT_SALTSPACE)
+		return NULL;
+
 	// arc4random_buf(csalt, sizeof(csalt));
     dev_urandom_buf(csalt, sizeof(csalt));
 
@@ -192,27 +192,40 @@ bcrypt_gensalt(u_int8_t log_rounds)
 	encode_salt(gsalt, csalt, BCRYPT_MAXSALT, log_rounds);
 	return gsalt;
 }
+
+/* Not reentrant, use bcrypt_gensalt_r() from threads */
+char *
+bcrypt_gensalt(u_int8_t log_rounds)
+{
+	static char gsalt[BCRYPT_SALTSPACE];
+
+	return bcrypt_gensalt_r(log_rounds, gsalt, sizeof(gsalt));
+}
+
 /* We handle $Vers$log2(NumRounds)$salt+passwd$
    i.e. $2$04$iwouldntknowwhattosayetKdJ6iFtacBqJdKe6aW7ou */
 
-char   *
-bcrypt(const char *key, const char *salt)
-{
-	blf_ctx state;
-	u_int32_t rounds, i, k;
-	u_int16_t j;
-	u_int8_t key_len, salt_len, logr, minor;
-	u_int8_t ciphertext[4 * BCRYPT_BLOCKS] = "OrpheanBeholderScryDoubt";
+/* Everything one hash needs besides the Blowfish state */
+struct bcrypt_lane {
+	u_int32_t rounds;
+	u_int8_t logr, minor;
 	u_int8_t csalt[BCRYPT_MAXSALT];
-	u_int32_t cdata[BCRYPT_BLOCKS];
+	u_int32_t keywords[BLF_N + 2], saltwords[BLF_N + 2];
+};
+
+/* Parses the salt and expands the key streams. Returns -1 on a bad salt. */
+static int
+bcrypt_setup(struct bcrypt_lane *lane, const char *key, const char *salt)
+{
+	u_int8_t key_len, salt_len, minor;
 	int n;
 
 	/* Discard "$" identifier */
 	salt++;
 
 	if (*salt > BCRYPT_VERSION) {
-		/* How do I handle errors ? Return ':' */
-		return error;
+		/* How do I handle errors ? Return -1 */
+		return -1;
 	}
 
 	/* Check for minor versions */
@@ -224,7 +237,7 @@ bcrypt(const char *key, const char *salt)
 			 salt++;
 			 break;
 		 default:
-			 return error;
+			 return -1;
 		 }
 	} else
 		 minor = 0;
@@ -234,35 +247,54 @@ bcrypt(const char *key, const char *salt)
 
 	if (salt[2] != '$')
 		/* Out of sync with passwd entry */
-		return error;
+		return -1;
 
 	/* Computer power doesn't increase linear, 2^x should be fine */
 	n = atoi(salt);
 	if (n > 31 || n < 0)
-		return error;
-	logr = (u_int8_t)n;
-	if ((rounds = (u_int32_t) 1 << logr) < BCRYPT_MINROUNDS)
-		return error;
+		return -1;
+	lane->logr = (u_int8_t)n;
+	if ((lane->rounds = (u_int32_t) 1 << lane->logr) < BCRYPT_MINROUNDS)
+		return -1;
+	lane->minor = minor;
 
 	/* Discard num rounds + "$" identifier */
 	salt += 3;
 
 	if (strlen(salt) * 3 / 4 < BCRYPT_MAXSALT)
-		return error;
+		return -1;
 
 	/* We dont want the base64 salt but the raw data */
-	decode_base64(csalt, BCRYPT_MAXSALT, (u_int8_t *) salt);
+	decode_base64(lane->csalt, BCRYPT_MAXSALT, (u_int8_t *) salt);
 	salt_len = BCRYPT_MAXSALT;
 	key_len = strlen(key) + (minor >= 'a' ? 1 : 0);
 
-	/* Setting up S-Boxes and Subkeys */
-	Blowfish_initstate(&state);
-	Blowfish_expandstate(&state, csalt, salt_len,
+	/* The rounds reuse the key streams, so expand them once */
+	Blowfish_keystream((u_int8_t *) key, key_len, lane->keywords);
+	Blowfish_keystream(lane->csalt, salt_len, lane->saltwords);
+	return 0;
+}
+
+/* Setting up S-Boxes and Subkeys, up to the expensive part */
+static void
+bcrypt_initstate(struct bcrypt_lane *lane, const char *key, blf_ctx *state)
+{
+	u_int8_t key_len = strlen(key) + (lane->minor >= 'a' ? 1 : 0);
+
+	Blowfish_initstate(state);
+	Blowfish_expandstate(state, lane->csalt, BCRYPT_MAXSALT,
 	    (u_int8_t *) key, key_len);
-	for (k = 0; k < rounds; k++) {
-		Blowfish_expand0state(&state, (u_int8_t *) key, key_len);
-		Blowfish_expand0state(&state, csalt, salt_len);
-	}
+}
+
+/* Encrypts the magic text with the expanded state and writes out
+   the hash. Wipes both lane and state. */
+static void
+bcrypt_finish(struct bcrypt_lane *lane, blf_ctx *state, char *encrypted)
+{
+	u_int32_t i, k;
+	u_int16_t j;
+	u_int8_t ciphertext[4 * BCRYPT_BLOCKS] = "OrpheanBeholderScryDoubt";
+	u_int32_t cdata[BCRYPT_BLOCKS];
 
 	/* This can be precomputed later */
 	j = 0;
@@ -271,7 +303,7 @@ bcrypt(const char *key, const char *salt)
 
 	/* Now do the encryption */
 	for (k = 0; k < 64; k++)
-		blf_enc(&state, cdata, BCRYPT_BLOCKS / 2);
+		blf_enc(state, cdata, BCRYPT_BLOCKS / 2);
 
 	for (i = 0; i < BCRYPT_BLOCKS; i++) {
 		ciphertext[4 * i + 3] = cdata[i] & 0xff;
@@ -287,19 +319,139 @@ bcrypt(const char *key, const char *salt)
 	i = 0;
 	encrypted[i++] = '$';
 	encrypted[i++] = BCRYPT_VERSION;
-	if (minor)
-		encrypted[i++] = minor;
+	if (lane->minor)
+		encrypted[i++] = lane->minor;
 	encrypted[i++] = '$';
 
-	snprintf(encrypted + i, 4, "%2.2u$", logr);
+	snprintf(encrypted + i, 4, "%2.2u$", lane->logr);
 
-	encode_base64((u_int8_t *) encrypted + i + 3, csalt, BCRYPT_MAXSALT);
+	encode_base64((u_int8_t *) encrypted + i + 3, lane->csalt,
+	    BCRYPT_MAXSALT);
 	encode_base64((u_int8_t *) encrypted + strlen(encrypted), ciphertext,
 	    4 * BCRYPT_BLOCKS - 1);
-	memset(&state, 0, sizeof(state));
+	memset(state, 0, sizeof(*state));
 	memset(ciphertext, 0, sizeof(ciphertext));
-	memset(csalt, 0, sizeof(csalt));
 	memset(cdata, 0, sizeof(cdata));
+	memset(lane, 0, sizeof(*lane));
+}
+
+/* The hash is written to encrypted, which must hold at least
+   BCRYPT_HASHSPACE bytes. state is scratch space, so every thread
+   brings its own. Returns 0 on success, -1 on a bad salt.
+ */
+int
+bcrypt_r(const char *key, const char *salt, char *encrypted, size_t size,
+    blf_ctx *state)
+{
+	struct bcrypt_lane lane;
+	u_int32_t k;
+	u_int8_t key_len;
+
+	if (size < BCRYPT_HASHSPACE)
+		return -1;
+
+	if (bcrypt_setup(&lane, key, salt) < 0) {
+		memset(&lane, 0, sizeof(lane));
+		return -1;
+	}
+
+	key_len = strlen(key) + (lane.minor >= 'a' ? 1 : 0);
+	bcrypt_initstate(&lane, key, state);
+	for (k = 0; k < lane.rounds; k++) {
+		Blowfish_expand0state(state, (u_int8_t *) key, key_len);
+		Blowfish_expand0state(state, lane.csalt, BCRYPT_MAXSALT);
+	}
+
+	bcrypt_finish(&lane, state, encrypted);
+	return 0;
+}
+
+/* Hashes n keys at once, the i-th key with the i-th salt, into
+   consecutive size byte slots of encrypted. Keys sharing a cost are
+   interleaved through the kernel's lanes, which gives more hashes per
+   second than n calls to bcrypt_r() but takes longer for each one.
+   states is scratch space for BLF_MAXLANES contexts. A key with a bad
+   salt gets an empty string. Returns -1 if size is too small.
+ */
+int
+bcrypt_multi(int n, const char *const *keys, const char *const *salts,
+    char *encrypted, size_t size, blf_ctx *states)
+{
+	struct bcrypt_lane lanes[BLF_MAXLANES];
+	u_int32_t keywords[BLF_MAXLANES][BLF_N + 2];
+	u_int32_t saltwords[BLF_MAXLANES][BLF_N + 2];
+	int idx[BLF_MAXLANES];
+	u_int8_t taken[n];
+	const blf_kernel *kernel;
+	u_int32_t rounds, k;
+	int i, g, lanes_max;
+
+	if (size < BCRYPT_HASHSPACE)
+		return -1;
+	if (n <= 0)
+		return 0;
+
+	kernel = Blowfish_kernel();
+	lanes_max = kernel->lanes < BLF_MAXLANES ? kernel->lanes : BLF_MAXLANES;
+	memset(taken, 0, sizeof(taken));
+
+	for (i = 0; i < n; i++)
+		encrypted[i * size] = '\0';
+
+	/* Gather keys of one cost into a group, then run it */
+	for (;;) {
+		g = 0;
+		rounds = 0;
+		for (i = 0; i < n && g < lanes_max; i++) {
+			if (taken[i])
+				continue;
+			if (bcrypt_setup(&lanes[g], keys[i], salts[i]) < 0) {
+				taken[i] = 1;
+				continue;
+			}
+			if (g > 0 && lanes[g].rounds != rounds)
+				continue;
+
+			rounds = lanes[g].rounds;
+			taken[i] = 1;
+			idx[g] = i;
+			memcpy(keywords[g], lanes[g].keywords, sizeof(keywords[g]));
+			memcpy(saltwords[g], lanes[g].saltwords,
+			    sizeof(saltwords[g]));
+			bcrypt_initstate(&lanes[g], keys[i], &states[g]);
+			g++;
+		}
+
+		if (g == 0)
+			break;
+
+		for (k = 0; k < rounds; k++) {
+			kernel->expand0state_multi(states, keywords, g);
+			kernel->expand0state_multi(states, saltwords, g);
+		}
+
+		while (g-- > 0)
+			bcrypt_finish(&lanes[g], &states[g],
+			    encrypted + idx[g] * size);
+	}
+
+	memset(lanes, 0, sizeof(lanes));
+	memset(keywords, 0, sizeof(keywords));
+	memset(saltwords, 0, sizeof(saltwords));
+	return 0;
+}
+
+/* Not reentrant, use bcrypt_r() from threads.
+   Returns ":" on errors. */
+char   *
+bcrypt(const char *key, const char *salt)
+{
+	static char encrypted[_PASSWORD_LEN];
+	static char error[] = ":";
+	blf_ctx state;
+
+	if (bcrypt_r(key, salt, encrypted, sizeof(encrypted), &state) < 0)
+		return error;
 	return encrypted;
 }
 
@@ -2,8 +2,26 @@
 #define _BCRYPT_H_
 
 #include <sys/types.h>
+#include "blf.h"
+
+/* Room needed for a salt and a hash, including the NUL */
+#define BCRYPT_SALTSPACE    30
+#define BCRYPT_HASHSPACE    61
 
 char   *bcrypt_gensalt(u_int8_t log_rounds);
 char   *bcrypt(const char *key, const char *salt);
 
+/* Reentrant versions, writing to caller-owned buffers */
+char   *bcrypt_gensalt_r(u_int8_t log_rounds, char *gsalt, size_t size);
+int     bcrypt_r(const char *key, const char *salt, char *encrypted,
+            size_t size, blf_ctx *state);
+
+/* Fills buf with random bytes */
+void    dev_urandom_buf(u_int8_t *buf, size_t size);
+
+/* Batch version, see bcrypt.c */
+int     bcrypt_multi(int n, const char *const *keys,
+            const char *const *salts, char *encrypted, size_t size,
+            blf_ctx *states);
+
 #endif /* _BCRYPT_H_ */
@@ -45,11 +45,17 @@
 #define BLF_MAXKEYLEN ((BLF_N-2)*4)	/* 448 bits */
 #define BLF_MAXUTILIZED ((BLF_N+2)*4)	/* 576 bits */
 
-/* Blowfish context */
+/* Blowfish context. Cache line aligned, so the S-Boxes span
+ * exactly 64 lines of L1.
+ */
 typedef struct BlowfishContext {
 	u_int32_t S[4][256];	/* S-Boxes */
 	u_int32_t P[BLF_N + 2];	/* Subkeys */
-} blf_ctx;
+}
+#ifdef __GNUC__
+__attribute__((aligned(64)))
+#endif
+blf_ctx;
 
 /* Raw access to customized Blowfish
  *	blf_key is just:
@@ -79,4 +85,25 @@ void blf_cbc_decrypt(blf_ctx *, u_int8_t *, u_int8_t *, u_int32_t);
 /* Converts u_int8_t to u_int32_t */
 u_int32_t Blowfish_stream2word(const u_int8_t *, u_int16_t , u_int16_t *);
 
+/* Multi-lane EksBlowfish, see eksblowfish.c
+ *	expand0state_multi is Blowfish_expand0state for up to
+ *	BLF_MAXLANES independent contexts at once, one key per
+ *	context, each already run through Blowfish_keystream
+ *	lanes is how many contexts it likes to be given
+ */
+#define BLF_MAXLANES	8
+
+typedef struct BlowfishKernel {
+	const char *name;
+	void (*expand0state_multi)(blf_ctx *, const u_int32_t (*)[BLF_N + 2],
+	    int);
+	int lanes;
+} blf_kernel;
+
+/* The fastest kernel for this CPU */
+const blf_kernel *Blowfish_kernel(void);
+
+/* Expands a key to the BLF_N + 2 words XORed into the subkeys */
+void Blowfish_keystream(const u_int8_t *, u_int16_t, u_int32_t *);
+
 #endif
@@ -0,0 +1,338 @@
+/*
+ * Copyright 2013, Tan Chee Eng (@tan-ce)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Kernels for the expensive part of bcrypt, the 2 * 2^cost calls to
+ * Blowfish_expand0state(), run for several hashes at once.
+ *
+ * A single encipher is one long chain of dependent S-box loads, so
+ * running several independent contexts in lock-step, with their
+ * rounds interleaved, fills the time spent waiting on each load.
+ * Where AVX2 is available, eight lanes are computed in vector
+ * registers with gathers. A single hash gains nothing from this and
+ * takes the reference code in blowfish.c (see bcrypt_r()).
+ *
+ * Kernels are listed in candidates[], best first. The first one
+ * which the CPU supports and which agrees with the reference code
+ * is used. On Android this file is built in ARM rather than Thumb
+ * mode (see Android.mk).
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include "blf.h"
+
+#if defined(__x86_64__) && defined(__GNUC__) && \
+    (__GNUC__ >= 5 || defined(__clang__))
+#define BLF_AVX2
+#include <immintrin.h>
+#endif
+
+#ifdef __GNUC__
+#define always_inline inline __attribute__((always_inline))
+#else
+#define always_inline inline
+#endif
+
+/* The four S-boxes of lane j as one array */
+#define SFLAT(j) ((u_int32_t *) c[j].S)
+
+/* The Feistel function of lane j */
+#define LF(j, x) \
+	(((c[j].S[0][(x) >> 24] + c[j].S[1][((x) >> 16) & 0xff]) \
+	 ^ c[j].S[2][((x) >> 8) & 0xff]) + c[j].S[3][(x) & 0xff])
+
+/* Encipher the blocks of n lanes, interleaving their rounds */
+#define LENCIPHER(n) do {					\
+	u_int32_t t_;						\
+	int j_, k_;						\
+	for (j_ = 0; j_ < (n); j_++)				\
+		l[j_] ^= c[j_].P[0];				\
+	for (k_ = 1; k_ <= BLF_N; k_ += 2) {			\
+		for (j_ = 0; j_ < (n); j_++)			\
+			r[j_] ^= LF(j_, l[j_]) ^ c[j_].P[k_];	\
+		for (j_ = 0; j_ < (n); j_++)			\
+			l[j_] ^= LF(j_, r[j_]) ^ c[j_].P[k_ + 1]; \
+	}							\
+	for (j_ = 0; j_ < (n); j_++) {				\
+		t_ = r[j_] ^ c[j_].P[BLF_N + 1];		\
+		r[j_] = l[j_];					\
+		l[j_] = t_;					\
+	}							\
+} while (0)
+
+/* n is a constant in every caller, so the lane loops unroll */
+static always_inline void
+lanes_expand0state(blf_ctx *c, const u_int32_t (*key)[BLF_N + 2], const int n)
+{
+	u_int32_t l[BLF_MAXLANES], r[BLF_MAXLANES];
+	int i, j;
+
+	for (j = 0; j < n; j++) {
+		for (i = 0; i < BLF_N + 2; i++)
+			c[j].P[i] ^= key[j][i];
+		l[j] = r[j] = 0;
+	}
+
+	for (i = 0; i < BLF_N + 2; i += 2) {
+		LENCIPHER(n);
+		for (j = 0; j < n; j++) {
+			c[j].P[i] = l[j];
+			c[j].P[i + 1] = r[j];
+		}
+	}
+
+	for (i = 0; i < 4 * 256; i += 2) {
+		LENCIPHER(n);
+		for (j = 0; j < n; j++) {
+			SFLAT(j)[i] = l[j];
+			SFLAT(j)[i + 1] = r[j];
+		}
+	}
+}
+
+/* The reference code, for when nothing else checks out */
+static void
+ref_expand0state(blf_ctx *c, const u_int32_t *key)
+{
+	u_int8_t bytes[4 * (BLF_N + 2)];
+	int i;
+
+	for (i = 0; i < BLF_N + 2; i++) {
+		bytes[4 * i + 0] = key[i] >> 24;
+		bytes[4 * i + 1] = key[i] >> 16;
+		bytes[4 * i + 2] = key[i] >> 8;
+		bytes[4 * i + 3] = key[i];
+	}
+	Blowfish_expand0state(c, bytes, sizeof(bytes));
+}
+
+static void
+ref_expand0state_multi(blf_ctx *c, const u_int32_t (*key)[BLF_N + 2], int n)
+{
+	for (; n; n--)
+		ref_expand0state(c++, *key++);
+}
+
+static void
+generic_expand0state_multi(blf_ctx *c, const u_int32_t (*key)[BLF_N + 2],
+    int n)
+{
+	for (; n >= 4; n -= 4, c += 4, key += 4)
+		lanes_expand0state(c, key, 4);
+	if (n >= 2) {
+		lanes_expand0state(c, key, 2);
+		n -= 2, c += 2, key += 2;
+	}
+	if (n)
+		ref_expand0state(c, key[0]);
+}
+
+static const blf_kernel blf_generic = {
+	"generic", generic_expand0state_multi, 4
+};
+
+#ifdef BLF_AVX2
+#define AVX2 __attribute__((target("avx2")))
+
+/* Eight lanes of the Feistel function, with one gather per S-box.
+ * base holds the offset of each lane's context in words. */
+#define VF(x) _mm256_add_epi32(_mm256_xor_si256(_mm256_add_epi32(	\
+	_mm256_i32gather_epi32(s, _mm256_add_epi32(base,		\
+	    _mm256_srli_epi32(x, 24)), 4),				\
+	_mm256_i32gather_epi32(s + 0x100, _mm256_add_epi32(base,	\
+	    _mm256_and_si256(_mm256_srli_epi32(x, 16), ff)), 4)),	\
+	_mm256_i32gather_epi32(s + 0x200, _mm256_add_epi32(base,	\
+	    _mm256_and_si256(_mm256_srli_epi32(x, 8), ff)), 4)),	\
+	_mm256_i32gather_epi32(s + 0x300, _mm256_add_epi32(base,	\
+	    _mm256_and_si256(x, ff)), 4))
+
+#define VRND(a, b, n) \
+	((a) = _mm256_xor_si256(a, _mm256_xor_si256(VF(b), p[n])))
+
+#define VENCIPHER() do {					\
+	__m256i t_;						\
+	l = _mm256_xor_si256(l, p[0]);				\
+	VRND(r, l, 1); VRND(l, r, 2);				\
+	VRND(r, l, 3); VRND(l, r, 4);				\
+	VRND(r, l, 5); VRND(l, r, 6);				\
+	VRND(r, l, 7); VRND(l, r, 8);				\
+	VRND(r, l, 9); VRND(l, r, 10);				\
+	VRND(r, l, 11); VRND(l, r, 12);				\
+	VRND(r, l, 13); VRND(l, r, 14);				\
+	VRND(r, l, 15); VRND(l, r, 16);				\
+	t_ = _mm256_xor_si256(r, p[17]);			\
+	r = l;							\
+	l = t_;							\
+} while (0)
+
+/* The subkeys live transposed in registers, one lane per element.
+ * S-box updates go to memory lane by lane, since AVX2 has no
+ * scatter. */
+static AVX2 void
+avx2_expand0state_8(blf_ctx *c, const u_int32_t (*key)[BLF_N + 2])
+{
+	const int *s = (const int *) c[0].S[0];
+	const __m256i ff = _mm256_set1_epi32(0xff);
+	const __m256i base = _mm256_mullo_epi32(
+	    _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7),
+	    _mm256_set1_epi32(sizeof(blf_ctx) / sizeof(u_int32_t)));
+	__m256i p[BLF_N + 2], l, r;
+	u_int32_t tl[8], tr[8];
+	int i, j;
+
+	for (i = 0; i < BLF_N + 2; i++) {
+		p[i] = _mm256_setr_epi32(
+		    c[0].P[i] ^ key[0][i], c[1].P[i] ^ key[1][i],
+		    c[2].P[i] ^ key[2][i], c[3].P[i] ^ key[3][i],
+		    c[4].P[i] ^ key[4][i], c[5].P[i] ^ key[5][i],
+		    c[6].P[i] ^ key[6][i], c[7].P[i] ^ key[7][i]);
+	}
+
+	l = r = _mm256_setzero_si256();
+	for (i = 0; i < BLF_N + 2; i += 2) {
+		VENCIPHER();
+		p[i] = l;
+		p[i + 1] = r;
+	}
+
+	for (i = 0; i < BLF_N + 2; i++) {
+		_mm256_storeu_si256((__m256i *) tl, p[i]);
+		for (j = 0; j < 8; j++)
+			c[j].P[i] = tl[j];
+	}
+
+	for (i = 0; i < 4 * 256; i += 2) {
+		VENCIPHER();
+		_mm256_storeu_si256((__m256i *) tl, l);
+		_mm256_storeu_si256((__m256i *) tr, r);
+		for (j = 0; j < 8; j++) {
+			SFLAT(j)[i] = tl[j];
+			SFLAT(j)[i + 1] = tr[j];
+		}
+	}
+}
+
+static AVX2 void
+avx2_expand0state_multi(blf_ctx *c, const u_int32_t (*key)[BLF_N + 2], int n)
+{
+	for (; n >= 8; n -= 8, c += 8, key += 8)
+		avx2_expand0state_8(c, key);
+	generic_expand0state_multi(c, key, n);
+}
+
+static int
+avx2_supported(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2");
+}
+
+static const blf_kernel blf_avx2 = {
+	"avx2", avx2_expand0state_multi, 8
+};
+#endif
+
+static const blf_kernel blf_reference = {
+	"reference", ref_expand0state_multi, 1
+};
+
+/* Candidates, best first */
+static const struct {
+	const blf_kernel *kernel;
+	int (*supported)(void);
+} candidates[] = {
+#ifdef BLF_AVX2
+	{ &blf_avx2, avx2_supported },
+#endif
+	{ &blf_generic, NULL },
+};
+
+static const blf_kernel *selected = &blf_reference;
+static pthread_once_t selected_once = PTHREAD_ONCE_INIT;
+
+/* Checks a kernel against the reference code on a known state */
+static int
+kernel_ok(const blf_kernel *k)
+{
+	static const u_int8_t salt[] = "pts-multi salt..";
+	static const u_int8_t key[] = "pts-multi known answer";
+	blf_ctx want, lanes[BLF_MAXLANES];
+	u_int32_t keywords[BLF_MAXLANES][BLF_N + 2];
+	int i, j, ret = 1;
+
+	Blowfish_initstate(&want);
+	Blowfish_expandstate(&want, salt, 16, key, sizeof(key));
+	for (j = 0; j < BLF_MAXLANES; j++) {
+		lanes[j] = want;
+		/* Give every lane a different key */
+		Blowfish_keystream(key, sizeof(key) - j, keywords[j]);
+	}
+
+	for (i = 0; i < 2; i++)
+		k->expand0state_multi(lanes, keywords, BLF_MAXLANES);
+
+	for (j = 0; j < BLF_MAXLANES; j++) {
+		Blowfish_initstate(&want);
+		Blowfish_expandstate(&want, salt, 16, key, sizeof(key));
+		for (i = 0; i < 2; i++)
+			ref_expand0state(&want, keywords[j]);
+		if (memcmp(&want, &lanes[j], sizeof(want)) != 0)
+			ret = 0;
+	}
+
+	memset(&want, 0, sizeof(want));
+	memset(lanes, 0, sizeof(lanes));
+	return ret;
+}
+
+static void
+select_kernel(void)
+{
+	size_t i;
+
+	for (i = 0; i < sizeof(candidates) / sizeof(candidates[0]); i++) {
+		if (candidates[i].supported && !candidates[i].supported())
+			continue;
+
+		if (kernel_ok(candidates[i].kernel)) {
+			selected = candidates[i].kernel;
+			return;
+		}
+
+		fprintf(stderr, "eksblowfish: %s kernel failed self-test\n",
+		    candidates[i].kernel->name);
+	}
+}
+
+const blf_kernel *
+Blowfish_kernel(void)
+{
+	pthread_once(&selected_once, select_kernel);
+	return selected;
+}
+
+void
+Blowfish_keystream(const u_int8_t *key, u_int16_t keybytes, u_int32_t *words)
+{
+	u_int16_t i, j;
+
+	j = 0;
+	for (i = 0; i < BLF_N + 2; i++)
+		words[i] = Blowfish_stream2word(key, keybytes, &j);
+}
@@ -0,0 +1,407 @@
+/*
+ * Copyright 2013, Tan Chee Eng (@tan-ce)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * Pool of password hashing threads
+ *
+ * Jobs move from the queue to the running list (while a thread
+ * hashes them) to the done list, which the event loop drains with
+ * hashpool_complete(). Cancelled jobs stay where they are with
+ * their owner cleared, and are dropped when they come around.
+ *
+ * When more jobs are queued than there are idle threads, a thread
+ * takes several jobs for the same hash and runs them through
+ * bcrypt_multi(), which gets through a burst of logins sooner.
+ *
+ * Identical verifications are done once. A job is keyed by an HMAC
+ * of the password and hash under a per-process random key, and a
+ * submission matching a queued or running job just joins its list of
+ * waiters. Nothing outlives the job, so this is no cache.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+
+#include "hashpool.h"
+#include "bcrypt.h"
+#include "sha256.h"
+
+struct hash_waiter {
+    struct hash_waiter *next;
+    void *owner;            // NULL once cancelled
+};
+
+struct hash_job {
+    struct hash_job *next;
+    struct hash_waiter *waiters;
+    int result;
+    uint8_t digest[SHA256_DIGEST_SIZE];
+    char hash[64];
+    char pwd[];
+};
+
+struct job_list {
+    struct hash_job *head, *tail;
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+
+static struct job_list queue, running, done;
+static int num_jobs = 0, max_jobs = 0;     // Counting every waiter
+static int num_queued = 0, idle_threads = 0;
+static int notify_fd = -1;
+static uint8_t digest_key[SHA256_DIGEST_SIZE];
+
+static void list_append(struct job_list *l, struct hash_job *job) {
+    job->next = NULL;
+    if (l->tail) l->tail->next = job;
+    else l->head = job;
+    l->tail = job;
+}
+
+static struct hash_job *list_pop(struct job_list *l) {
+    struct hash_job *job = l->head;
+
+    if (job) {
+        l->head = job->next;
+        if (!l->head) l->tail = NULL;
+    }
+    return job;
+}
+
+static void list_remove(struct job_list *l, struct hash_job *job) {
+    struct hash_job **pp, *prev = NULL;
+
+    for (pp = &l->head; *pp; prev = *pp, pp = &(*pp)->next) {
+        if (*pp == job) {
+            *pp = job->next;
+            if (l->tail == job) l->tail = prev;
+            return;
+        }
+    }
+}
+
+static void list_cancel(struct job_list *l, void *owner) {
+    struct hash_waiter *w;
+    struct hash_job *job;
+
+    for (job = l->head; job; job = job->next) {
+        for (w = job->waiters; w; w = w->next) {
+            if (w->owner == owner) w->owner = NULL;
+        }
+    }
+}
+
+static struct hash_job *list_find(struct job_list *l, const uint8_t *digest) {
+    struct hash_job *job;
+
+    for (job = l->head; job; job = job->next) {
+        if (memcmp(job->digest, digest, sizeof(job->digest)) == 0) break;
+    }
+    return job;
+}
+
+// Whether anybody is still waiting for job
+static int job_live(struct hash_job *job) {
+    struct hash_waiter *w;
+
+    for (w = job->waiters; w; w = w->next) {
+        if (w->owner) return 1;
+    }
+    return 0;
+}
+
+// Wipes and frees a job, with its waiters. Call with the lock held.
+static void job_free(struct hash_job *job) {
+    struct hash_waiter *w;
+
+    while ((w = job->waiters)) {
+        job->waiters = w->next;
+        free(w);
+        num_jobs--;
+    }
+    memset(job->pwd, '\0', strlen(job->pwd));
+    free(job);
+}
+
+// Compares the password against the hash, using the
+// calling thread's own Blowfish state
+static int verify(struct hash_job *job, blf_ctx *state) {
+    char calc_hash[BCRYPT_HASHSPACE];
+    int ret;
+
+    if (bcrypt_r(job->pwd, job->hash, calc_hash, sizeof(calc_hash), state) < 0) {
+        return HASH_BAD;
+    }
+
+    ret = strcmp(job->hash, calc_hash) == 0 ? HASH_MATCH : HASH_MISMATCH;
+    memset(calc_hash, '\0', sizeof(calc_hash));
+    return ret;
+}
+
+// Same as verify(), for several jobs at once
+static void verify_multi(struct hash_job **batch, int n, blf_ctx *states) {
+    const char *keys[BLF_MAXLANES], *salts[BLF_MAXLANES];
+    char calc_hash[BLF_MAXLANES][BCRYPT_HASHSPACE];
+    int i;
+
+    for (i = 0; i < n; i++) {
+        keys[i] = batch[i]->pwd;
+        salts[i] = batch[i]->hash;
+    }
+
+    bcrypt_multi(n, keys, salts, calc_hash[0], BCRYPT_HASHSPACE, states);
+
+    for (i = 0; i < n; i++) {
+        if (calc_hash[i][0] == '\0') {
+            batch[i]->result = HASH_BAD;
+        } else {
+            batch[i]->result = strcmp(batch[i]->hash, calc_hash[i]) == 0 ?
+                HASH_MATCH : HASH_MISMATCH;
+        }
+    }
+    memset(calc_hash, '\0', sizeof(calc_hash));
+}
+
+// Takes the next job off the queue, along with a fair share of the
+// queued jobs for the same hash (hence the same cost).
+// Call with the lock held. Returns the number of jobs taken.
+static int take_batch(struct hash_job **batch, int lanes) {
+    struct hash_job *job, *next;
+    int n = 0, share;
+
+    // Drop what nobody's waiting for any more
+    while ((job = list_pop(&queue))) {
+        num_queued--;
+        if (job_live(job)) break;
+        job_free(job);
+    }
+    if (!job) return 0;
+    batch[n++] = job;
+
+    // Leave something for the threads which are idle
+    share = (num_queued + 1 + idle_threads) / (idle_threads + 1);
+    if (share > lanes) share = lanes;
+
+    for (job = queue.head; job && n < share; job = next) {
+        next = job->next;
+        if (!job_live(job) || strcmp(job->hash, batch[0]->hash) != 0) continue;
+        list_remove(&queue, job);
+        num_queued--;
+        batch[n++] = job;
+    }
+
+    return n;
+}
+
+static void *hash_thread(void *arg) {
+    struct hash_job *batch[BLF_MAXLANES];
+    blf_ctx *states = arg;
+    uint64_t one = 1;
+    int i, n, lanes;
+
+    lanes = Blowfish_kernel()->lanes;
+    if (lanes > BLF_MAXLANES) lanes = BLF_MAXLANES;
+
+    pthread_mutex_lock(&lock);
+    while (1) {
+        n = take_batch(batch, lanes);
+        if (!n) {
+            idle_threads++;
+            pthread_cond_wait(&queue_cond, &lock);
+            idle_threads--;
+            continue;
+        }
+
+        for (i = 0; i < n; i++) list_append(&running, batch[i]);
+        pthread_mutex_unlock(&lock);
+
+        if (n == 1) batch[0]->result = verify(batch[0], states);
+        else verify_multi(batch, n, states);
+
+        pthread_mutex_lock(&lock);
+        for (i = 0; i < n; i++) {
+            list_remove(&running, batch[i]);
+            list_append(&done, batch[i]);
+        }
+
+        // Wake up the event loop
+        if (write(notify_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+            perror("hashpool: Unable to post result");
+        }
+    }
+
+    return NULL;
+}
+
+// Starts the hashing threads. At most max_pending verifications
+// may be queued or running at any time.
+// Returns an FD which becomes readable when results are ready,
+// or -1 on failure.
+int hashpool_init(int nthreads, int max_pending) {
+    pthread_t thread;
+    blf_ctx *states;
+    int i;
+
+    notify_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (notify_fd < 0) {
+        perror("hashpool: eventfd() failed");
+        return -1;
+    }
+
+    max_jobs = max_pending;
+    dev_urandom_buf(digest_key, sizeof(digest_key));
+
+    for (i = 0; i < nthreads; i++) {
+        // Each thread's scratch space for bcrypt_multi(), aligned
+        // as blf_ctx asks, which malloc() doesn't promise
+        errno = posix_memalign((void **) &states, __alignof__(blf_ctx),
+                sizeof(*states) * BLF_MAXLANES);
+        if (errno) states = NULL;
+        else errno = pthread_create(&thread, NULL, &hash_thread, states);
+        if (errno) {
+            perror("hashpool: Unable to start thread");
+            free(states);
+            // Make do with what we have
+            if (i > 0) break;
+            close(notify_fd);
+            return -1;
+        }
+        pthread_detach(thread);
+    }
+
+    return notify_fd;
+}
+
+// Queue the verification of pwd against hash on behalf of owner
+// Returns 0 on success, -1 if the queue is full
+int hashpool_submit(void *owner, const char *pwd, const char *hash) {
+    uint8_t digest[SHA256_DIGEST_SIZE];
+    hmac_sha256_ctx hmac;
+    struct hash_waiter *w;
+    struct hash_job *job, *same;
+
+    pthread_mutex_lock(&lock);
+    if (num_jobs >= max_jobs) {
+        pthread_mutex_unlock(&lock);
+        return -1;
+    }
+    num_jobs++;
+    pthread_mutex_unlock(&lock);
+
+    // Both strings with their NULs, so that the split is unambiguous
+    hmac_sha256_init(&hmac, digest_key, sizeof(digest_key));
+    hmac_sha256_update(&hmac, pwd, strlen(pwd) + 1);
+    hmac_sha256_update(&hmac, hash, strlen(hash) + 1);
+    hmac_sha256_final(&hmac, digest);
+
+    w = malloc(sizeof(*w));
+    job = malloc(sizeof(*job) + strlen(pwd) + 1);
+    if (!w || !job) {
+        free(w);
+        free(job);
+        pthread_mutex_lock(&lock);
+        num_jobs--;
+        pthread_mutex_unlock(&lock);
+        return -1;
+    }
+    w->owner = owner;
+
+    pthread_mutex_lock(&lock);
+
+    // Wait on an identical verification, if one is underway
+    same = list_find(&queue, digest);
+    if (!same) same = list_find(&running, digest);
+    if (same) {
+        w->next = same->waiters;
+        same->waiters = w;
+        pthread_mutex_unlock(&lock);
+        free(job);
+        return 0;
+    }
+
+    w->next = NULL;
+    job->waiters = w;
+    job->result = HASH_MISMATCH;
+    memcpy(job->digest, digest, sizeof(digest));
+    strncpy(job->hash, hash, sizeof(job->hash));
+    job->hash[sizeof(job->hash) - 1] = '\0';
+    strcpy(job->pwd, pwd);
+
+    list_append(&queue, job);
+    num_queued++;
+    pthread_cond_signal(&queue_cond);
+    pthread_mutex_unlock(&lock);
+
+    return 0;
+}
+
+// Forget every verification queued by owner. Its callback will
+// not be invoked.
+void hashpool_cancel(void *owner) {
+    pthread_mutex_lock(&lock);
+    list_cancel(&queue, owner);
+    list_cancel(&running, owner);
+    list_cancel(&done, owner);
+    pthread_mutex_unlock(&lock);
+}
+
+// Invokes cb for every finished verification. Call this when the
+// FD returned by hashpool_init() is readable.
+void hashpool_complete(hashpool_cb cb) {
+    struct hash_waiter *w;
+    struct hash_job *job;
+    uint64_t count;
+    void *owner;
+    int result;
+
+    // Reset the notification
+    if (read(notify_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        perror("hashpool: Unable to read notification");
+    }
+
+    // One waiter at a time, since a callback may cancel other jobs
+    while (1) {
+        pthread_mutex_lock(&lock);
+        job = done.head;
+        if (!job) {
+            pthread_mutex_unlock(&lock);
+            break;
+        }
+        w = job->waiters;
+        if (!w) {
+            list_pop(&done);
+            job_free(job);
+            pthread_mutex_unlock(&lock);
+            continue;
+        }
+        job->waiters = w->next;
+        owner = w->owner;
+        result = job->result;
+        free(w);
+        num_jobs--;
+        pthread_mutex_unlock(&lock);
+
+        if (owner) cb(owner, result);
+    }
+}
@@ -0,0 +1,51 @@
+/*
+ * Copyright 2013, Tan Chee Eng (@tan-ce)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * Pool of threads which verify passwords, so that a slow bcrypt
+ * never holds up the daemon's event loop.
+ */
+
+#ifndef _HASHPOOL_H_
+#define _HASHPOOL_H_
+
+// Verification results
+#define HASH_MISMATCH   0
+#define HASH_MATCH      1
+#define HASH_BAD        -1  // The stored hash is invalid
+
+// Called for every finished verification of a live owner
+typedef void (*hashpool_cb)(void *owner, int result);
+
+// Starts the hashing threads. At most max_pending verifications
+// may be queued or running at any time.
+// Returns an FD which becomes readable when results are ready,
+// or -1 on failure.
+int hashpool_init(int nthreads, int max_pending);
+
+// Queue the verification of pwd against hash on behalf of owner
+// Returns 0 on success, -1 if the queue is full
+int hashpool_submit(void *owner, const char *pwd, const char *hash);
+
+// Forget every verification queued by owner. Its callback will
+// not be invoked.
+void hashpool_cancel(void *owner);
+
+// Invokes cb for every finished verification. Call this when the
+// FD returned by hashpool_init() is readable.
+void hashpool_complete(hashpool_cb cb);
+
+#endif
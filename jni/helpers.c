@@ -17,7 +17,7 @@
 /**
  * Collection of helper functions
  */
-#define _XOPEN_SOURCE
+#define _GNU_SOURCE
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -27,7 +27,11 @@
 #include <string.h>
 #include <errno.h>
 #include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 #include <signal.h>
+#include <time.h>
 
 #include "helpers.h"
 #include "bcrypt.h"
@@ -159,6 +163,80 @@ int write_to_fd(int fd, unsigned char buf[], ssize_t bufsz) {
     return 0;
 }
 
+// Sends buf on a unix socket, passing n descriptors along with it
+// Returns the number of bytes sent, or -1 with errno set
+ssize_t send_fds(int sck, const void *buf, size_t len, const int *fds, int n) {
+    char cbuf[CMSG_SPACE(sizeof(int) * MAX_PASSED_FDS)];
+    struct cmsghdr *cmsg;
+    struct msghdr msg;
+    struct iovec iov;
+    ssize_t ret;
+
+    if (n > MAX_PASSED_FDS) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    memset(&msg, '\0', sizeof(msg));
+    memset(cbuf, '\0', sizeof(cbuf));
+    iov.iov_base = (void *) buf;
+    iov.iov_len = len;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * n);
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * n);
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * n);
+
+    do {
+        ret = sendmsg(sck, &msg, MSG_NOSIGNAL);
+    } while (ret < 0 && errno == EINTR);
+    return ret;
+}
+
+// Reads from a unix socket like read(). Descriptors passed with the
+// data are added to fds, which has room for max and holds *n already.
+// Any which don't fit are closed.
+ssize_t recv_fds(int sck, void *buf, size_t len, int *fds, int *n, int max) {
+    char cbuf[CMSG_SPACE(sizeof(int) * MAX_PASSED_FDS)];
+    struct cmsghdr *cmsg;
+    struct msghdr msg;
+    struct iovec iov;
+    ssize_t ret;
+    int i, count, fd;
+
+    memset(&msg, '\0', sizeof(msg));
+    iov.iov_base = buf;
+    iov.iov_len = len;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+
+    do {
+        ret = recvmsg(sck, &msg, MSG_CMSG_CLOEXEC);
+    } while (ret < 0 && errno == EINTR);
+    if (ret < 0) return ret;
+
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+            continue;
+        }
+        count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (i = 0; i < count; i++) {
+            memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+            if (*n < max) fds[(*n)++] = fd;
+            else close(fd);
+        }
+    }
+
+    return ret;
+}
+
 // Read the contents of a file
 ssize_t load_file(char *file, char *buf, size_t buf_len) {
     FILE *fp;
@@ -284,6 +362,14 @@ void daemonize(void) {
     freopen("/dev/null", "w", stderr);
 }
 
+// Milliseconds on the monotonic clock
+int64_t now_ms(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
 /**
  * pts_open
  *
@@ -298,23 +384,32 @@ void daemonize(void) {
  * on success, the file descriptor of the master device is returned.
  */
 int pts_open(char *slave_name, size_t slave_name_size) {
-    int fdm;
-    char *sn_tmp;
-        
+    unsigned int num;
+    int fdm, unlock = 0;
+
     // Open master ptmx device
-    fdm = open("/dev/ptmx", O_RDWR);
+    fdm = open("/dev/ptmx", O_RDWR | O_NOCTTY | O_CLOEXEC);
     if (fdm == -1) return -1;
 
+    // devpts hands us the slave with the right owner already, so
+    // grantpt() has nothing to do. Asking the kernel directly also
+    // saves the libc's checks on the slave (and on some, a fork).
+    if (ioctl(fdm, TIOCGPTN, &num) == 0 &&
+            ioctl(fdm, TIOCSPTLCK, &unlock) == 0) {
+        if ((size_t) snprintf(slave_name, slave_name_size, "/dev/pts/%u", num)
+                >= slave_name_size) {
+            close(fdm);
+            return -2;
+        }
+        return fdm;
+    }
+
     // Get the slave name
-    sn_tmp = ptsname(fdm);
-    if (!sn_tmp) {
+    if (ptsname_r(fdm, slave_name, slave_name_size) != 0) {
         close(fdm);
         return -2;
     }
 
-    strncpy(slave_name, sn_tmp, slave_name_size);
-    slave_name[slave_name_size - 1] = '\0';
-
     // Grant, then unlock
     if (grantpt(fdm) == -1) {
         close(fdm);
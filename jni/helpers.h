@@ -22,6 +22,7 @@
 #define _HELPERS_H_
 
 #include <stddef.h>
+#include <stdint.h>
 #include <termios.h>
 
 #define PATH_PREFIX    "/data/pts"
@@ -45,6 +46,18 @@ void terminate_buf(char *buf, size_t buf_len);
 // Simply write to a given file descriptor
 int write_to_fd(int fd, unsigned char buf[], ssize_t bufsz);
 
+// Most descriptors passed with one message
+#define MAX_PASSED_FDS  4
+
+// Sends buf on a unix socket, passing n descriptors along with it
+// Returns the number of bytes sent, or -1 with errno set
+ssize_t send_fds(int sck, const void *buf, size_t len, const int *fds, int n);
+
+// Reads from a unix socket like read(). Descriptors passed with the
+// data are added to fds, which has room for max and holds *n already.
+// Any which don't fit are closed.
+ssize_t recv_fds(int sck, void *buf, size_t len, int *fds, int *n, int max);
+
 // Read the contents of a file
 ssize_t load_file(char *file, char *buf, size_t buf_len);
 
@@ -68,6 +81,9 @@ int check_path(const char *path);
 // Daemonizes the process
 void daemonize(void);
 
+// Milliseconds on the monotonic clock
+int64_t now_ms(void);
+
 /**
  * pts_open
  *
@@ -80,6 +96,7 @@ void daemonize(void);
  * return values
  * on failure either -2 or -1 (errno set) is returned.
  * on success, the file descriptor of the master device is returned.
+ * it is close-on-exec, and never becomes the controlling terminal.
  */
 int pts_open(char *slave_name, size_t slave_name_size);
 
@@ -0,0 +1,113 @@
+/*
+ * Copyright 2013, Tan Chee Eng (@tan-ce)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "policy.h"
+
+#define POLICY_MAX_RULES    64
+
+struct policy_rule {
+    int action;
+    int is_gid;
+    int any;
+    unsigned long id;
+};
+
+static struct policy_rule rules[POLICY_MAX_RULES];
+static int num_rules = 0;
+
+// Parses one line into rule
+// Returns 1 for a rule, 0 for a blank line, -1 on a syntax error
+static int parse_rule(char *line, struct policy_rule *rule) {
+    char *action, *kind, *id, *end;
+
+    end = strchr(line, '#');
+    if (end) *end = '\0';
+
+    action = strtok(line, " \t\r\n");
+    if (!action) return 0;
+    kind = strtok(NULL, " \t\r\n");
+    id = strtok(NULL, " \t\r\n");
+    if (!kind || !id || strtok(NULL, " \t\r\n")) return -1;
+
+    if (strcmp(action, "trust") == 0) rule->action = POLICY_TRUST;
+    else if (strcmp(action, "deny") == 0) rule->action = POLICY_DENY;
+    else return -1;
+
+    if (strcmp(kind, "uid") == 0) rule->is_gid = 0;
+    else if (strcmp(kind, "gid") == 0) rule->is_gid = 1;
+    else return -1;
+
+    rule->any = strcmp(id, "*") == 0;
+    if (!rule->any) {
+        errno = 0;
+        rule->id = strtoul(id, &end, 10);
+        if (errno || *end) return -1;
+    }
+
+    return 1;
+}
+
+int policy_load(const char *path) {
+    struct policy_rule new_rules[POLICY_MAX_RULES];
+    int n = 0, lineno = 0, ret;
+    char line[256];
+    FILE *fp;
+
+    fp = fopen(path, "r");
+    if (!fp) {
+        if (errno == ENOENT) {
+            num_rules = 0;
+            return 0;
+        }
+        perror("Warning: Unable to read policy file");
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), fp)) {
+        lineno++;
+        ret = parse_rule(line, &new_rules[n]);
+        if (ret < 0) {
+            printf("Warning: %s:%d: bad rule, ignored\n", path, lineno);
+        } else if (ret > 0 && ++n == POLICY_MAX_RULES) {
+            printf("Warning: %s: only the first %d rules are used\n",
+                    path, POLICY_MAX_RULES);
+            break;
+        }
+    }
+    fclose(fp);
+
+    memcpy(rules, new_rules, n * sizeof(*rules));
+    num_rules = n;
+    return 0;
+}
+
+int policy_check(uid_t uid, gid_t gid) {
+    unsigned long id;
+    int i;
+
+    for (i = 0; i < num_rules; i++) {
+        id = rules[i].is_gid ? (unsigned long) gid : (unsigned long) uid;
+        if (rules[i].any || rules[i].id == id) return rules[i].action;
+    }
+
+    return POLICY_PASSWORD;
+}
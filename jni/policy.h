@@ -0,0 +1,46 @@
+/*
+ * Copyright 2013, Tan Chee Eng (@tan-ce)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+/**
+ * Who may use the daemon without a password, and who may not use
+ * it at all. Rules are read from PATH_PREFIX "/policy", one per line:
+ *
+ *   trust uid 2000     # No password needed
+ *   deny gid 3003      # Turned away at the door
+ *   deny uid *         # Any uid, for a default at the end
+ *
+ * The first rule matching the peer applies. Peers matching no rule
+ * need the password. gid rules only see the peer's primary group.
+ */
+
+#ifndef _POLICY_H_
+#define _POLICY_H_
+
+#include <sys/types.h>
+
+#define POLICY_DENY         -1
+#define POLICY_PASSWORD     0
+#define POLICY_TRUST        1
+
+// Reads the policy file. A missing file means no rules.
+// Returns -1 if the file couldn't be read; the old rules are kept.
+int policy_load(const char *path);
+
+// Returns what to do with a peer
+int policy_check(uid_t uid, gid_t gid);
+
+#endif
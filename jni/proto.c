@@ -0,0 +1,125 @@
+/*
+ * Copyright 2013, Tan Chee Eng (@tan-ce)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "proto.h"
+
+// Makes room for n more bytes
+static int proto_reserve(struct proto_buf *b, size_t n) {
+    size_t size;
+    char *data;
+
+    if (b->len + n > sizeof(struct proto_hdr) + PROTO_MAX_MSG) return -1;
+    if (b->len + n <= b->size) return 0;
+
+    size = b->size ? b->size : 256;
+    while (size < b->len + n) size *= 2;
+
+    data = realloc(b->data, size);
+    if (!data) return -1;
+    b->data = data;
+    b->size = size;
+    return 0;
+}
+
+int proto_begin(struct proto_buf *b, uint16_t type) {
+    struct proto_hdr hdr;
+
+    b->len = 0;
+    if (proto_reserve(b, sizeof(hdr)) < 0) return -1;
+
+    memset(&hdr, '\0', sizeof(hdr));
+    hdr.type = type;
+    memcpy(b->data, &hdr, sizeof(hdr));
+    b->len = sizeof(hdr);
+    return 0;
+}
+
+int proto_add(struct proto_buf *b, uint16_t tag, const void *val, size_t len) {
+    struct proto_tlv tlv;
+
+    if (len > PROTO_MAX_MSG) return -1;
+    if (proto_reserve(b, sizeof(tlv) + PROTO_PAD(len)) < 0) return -1;
+
+    memset(&tlv, '\0', sizeof(tlv));
+    tlv.tag = tag;
+    tlv.len = len;
+    memcpy(b->data + b->len, &tlv, sizeof(tlv));
+    b->len += sizeof(tlv);
+
+    memcpy(b->data + b->len, val, len);
+    memset(b->data + b->len + len, '\0', PROTO_PAD(len) - len);
+    b->len += PROTO_PAD(len);
+    return 0;
+}
+
+int proto_add_str(struct proto_buf *b, uint16_t tag, const char *str) {
+    return proto_add(b, tag, str, strlen(str) + 1);
+}
+
+int proto_add_u32(struct proto_buf *b, uint16_t tag, uint32_t val) {
+    return proto_add(b, tag, &val, sizeof(val));
+}
+
+void proto_end(struct proto_buf *b) {
+    struct proto_hdr *hdr = (struct proto_hdr *) b->data;
+
+    hdr->len = b->len - sizeof(*hdr);
+}
+
+void proto_free(struct proto_buf *b) {
+    if (b->data) memset(b->data, '\0', b->len);
+    free(b->data);
+    b->data = NULL;
+    b->len = b->size = 0;
+}
+
+int proto_next(const char *body, uint32_t len, uint32_t *off,
+        struct proto_field *f) {
+    struct proto_tlv tlv;
+
+    if (*off >= len) return 0;
+    if (len - *off < sizeof(tlv)) return -1;
+
+    memcpy(&tlv, body + *off, sizeof(tlv));
+    *off += sizeof(tlv);
+    if (tlv.len > len - *off) return -1;
+
+    f->tag = tlv.tag;
+    f->len = tlv.len;
+    f->val = body + *off;
+
+    // The last field's padding may be left off
+    *off += tlv.len;
+    *off = PROTO_PAD(*off) < len ? PROTO_PAD(*off) : len;
+    return 1;
+}
+
+const char *proto_str(const struct proto_field *f) {
+    if (f->len == 0 || f->val[f->len - 1] != '\0') return NULL;
+    return f->val;
+}
+
+uint32_t proto_u32(const struct proto_field *f, uint32_t def) {
+    uint32_t val;
+
+    if (f->len != sizeof(val)) return def;
+    memcpy(&val, f->val, sizeof(val));
+    return val;
+}
@@ -0,0 +1,152 @@
+/*
+ * Copyright 2013, Tan Chee Eng (@tan-ce)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+/**
+ * Version 2 of the control protocol
+ *
+ * A client switches to it by sending the text line "v2"; a daemon
+ * which knows it answers "1 v2", and everything after that is
+ * binary. Older daemons answer with a "0" line, and the client
+ * carries on with text.
+ *
+ * Each message is a proto_hdr followed by hdr.len bytes of fields.
+ * Each field is a proto_tlv followed by its value, padded to a
+ * multiple of 4 bytes. Strings include their NUL, so they can be
+ * used where they lie in the receive buffer. Both ends are on the
+ * same machine, so everything is in host byte order.
+ */
+
+#ifndef _PROTO_H_
+#define _PROTO_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define PROTO_V2_HELLO      "v2"
+
+// Largest message either side accepts
+#define PROTO_MAX_MSG       (64 * 1024)
+
+struct proto_hdr {
+    uint32_t len;           // Of the fields after the header
+    uint16_t type;
+    uint16_t reserved;
+};
+
+struct proto_tlv {
+    uint16_t tag;
+    uint16_t reserved;
+    uint32_t len;           // Of the value, without padding
+};
+
+#define PROTO_PAD(n)        (((n) + 3) & ~(size_t) 3)
+
+// Message types. The daemon answers each request with one reply.
+#define PROTO_AUTH          1   // PASSWORD
+#define PROTO_TICKET        2   // TICKET
+#define PROTO_PEER          3   // (nothing)
+#define PROTO_EXEC          4   // [PTS], ARG..., [ENV...], [CWD],
+                                // [TERMIOS], [WINSIZE], [FLAGS]
+#define PROTO_LAUNCH        5   // [TICKET], [PASSWORD], then as EXEC
+#define PROTO_REPLY         128 // STATUS, MSG, [TICKET], [PID], [WARNING],
+                                // [STAGE], [PTM], [PIPES]
+#define PROTO_EXIT          129 // EXIT or SIGNAL, see PROTO_F_DIRECT
+
+// Field tags
+#define PROTO_T_STATUS      1   // uint32_t, 1 for success
+#define PROTO_T_MSG         2   // string
+#define PROTO_T_PASSWORD    3   // string
+#define PROTO_T_TICKET      4   // string
+#define PROTO_T_PTS         5   // string
+#define PROTO_T_ARG         6   // string, one per argv entry
+#define PROTO_T_ENV         7   // string, NAME=value
+#define PROTO_T_CWD         8   // string
+#define PROTO_T_TERMIOS     9   // struct termios
+#define PROTO_T_WINSIZE     10  // struct winsize
+#define PROTO_T_PID         11  // int32_t
+#define PROTO_T_WARNING     12  // string
+#define PROTO_T_STAGE       13  // uint32_t, what a LAUNCH got up to
+#define PROTO_T_FLAGS       14  // uint32_t, PROTO_F_*
+#define PROTO_T_PTM         15  // (nothing), see PROTO_F_TAKE_PTY
+#define PROTO_T_EXIT        16  // uint32_t, the command's exit status
+#define PROTO_T_SIGNAL      17  // uint32_t, the signal which killed it
+#define PROTO_T_PIPES       18  // (nothing), see PROTO_F_PIPES
+
+// Request flags
+#define PROTO_F_TAKE_PTY    1   // The client relays any PTY it's given.
+                                // The daemon may then run the command on
+                                // a PTY of its own (and always does if
+                                // there's no PTS field), in which case the
+                                // reply has a PTM field and the master
+                                // comes with it as SCM_RIGHTS.
+#define PROTO_F_DIRECT      2   // The request comes with the client's
+                                // stdin, stdout, stderr and working
+                                // directory as SCM_RIGHTS, in that order.
+                                // The command runs on them without a
+                                // terminal, and a PROTO_EXIT follows the
+                                // reply once it ends.
+#define PROTO_F_PIPES       4   // The command runs on pipes made by the
+                                // daemon, without a terminal. The reply
+                                // has a PIPES field, and the other ends
+                                // of stdin, stdout and stderr come with
+                                // it as SCM_RIGHTS, in that order. A
+                                // PROTO_EXIT follows as with DIRECT.
+
+// Stages of a LAUNCH. A failed launch says which one failed.
+#define PROTO_STAGE_AUTH    1
+#define PROTO_STAGE_EXEC    2
+
+// A message being built
+struct proto_buf {
+    char *data;
+    size_t len, size;
+};
+
+// A field found by proto_next()
+struct proto_field {
+    uint16_t tag;
+    uint32_t len;
+    const char *val;
+};
+
+// Starts a message of the given type in b, which is grown as needed
+// Returns -1 if out of memory
+int proto_begin(struct proto_buf *b, uint16_t type);
+
+// Appends a field. Returns -1 if out of memory, or if the message
+// would be larger than PROTO_MAX_MSG.
+int proto_add(struct proto_buf *b, uint16_t tag, const void *val, size_t len);
+int proto_add_str(struct proto_buf *b, uint16_t tag, const char *str);
+int proto_add_u32(struct proto_buf *b, uint16_t tag, uint32_t val);
+
+// Fills in the header. The message is b->data, b->len bytes long.
+void proto_end(struct proto_buf *b);
+
+void proto_free(struct proto_buf *b);
+
+// Steps through the fields of a message body, starting with *off 0
+// Returns 1 with the next field in f, 0 at the end, -1 if malformed
+int proto_next(const char *body, uint32_t len, uint32_t *off,
+        struct proto_field *f);
+
+// The value of a string field, or NULL if it isn't NUL terminated
+const char *proto_str(const struct proto_field *f);
+
+// The value of a uint32_t field, or def if it's the wrong size
+uint32_t proto_u32(const struct proto_field *f, uint32_t def);
+
+#endif
@@ -14,24 +14,184 @@
  * limitations under the License.
  */
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <errno.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <fcntl.h>
 #include <string.h>
 #include <signal.h>
-#include <poll.h>
+#include <sys/signalfd.h>
+#include <sys/wait.h>
 #include <sys/stat.h>
-#include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <termios.h>
+#include <time.h>
 
 #include "helpers.h"
-#include "bcrypt.h"
+#include "hashpool.h"
+#include "ticket.h"
+#include "policy.h"
+#include "proto.h"
+#include "zygote.h"
+#include "ptypool.h"
+
+pid_t pts_spawn(int pts_fd, char **cmd_argv, char **env, int cwd_fd,
+        const struct termios *tio, const struct winsize *ws,
+        const char **failed);
+pid_t fd_spawn(const int *stdio, char **cmd_argv, char **env, int cwd_fd,
+        const char **failed);
+
+#define LISTEN_BACKLOG  16
+#define MAX_EVENTS      32
+
+// Most password verifications in flight per process
+#define AUTH_MAX_PENDING    64
+
+// PTYs kept open ahead of time, by default
+#define PTY_POOL_SIZE       2
+
+// Default lifetime of a session ticket, in seconds
+#define TICKET_LIFETIME     300
+
+// A worker which fails to fork, or dies sooner than RESPAWN_MIN_LIFE
+// after starting, is respawned after a delay. It doubles each time,
+// up to RESPAWN_MAX_DELAY. All in milliseconds.
+#define RESPAWN_MIN_LIFE    1000
+#define RESPAWN_MIN_DELAY   1000
+#define RESPAWN_MAX_DELAY   32000
+
+// Length of a bcrypt hash in the passwd file
+#define HASH_LEN            60
+
+// Size of the per-connection buffers. Text requests are parsed
+// as they come in, so their lines may be longer than this. v2
+// messages grow the input buffer up to PROTO_MAX_MSG.
+#define CONN_IN_SIZE    128
+#define CONN_OUT_SIZE   1024
+
+// An arena bigger than this is freed once its request is done
+#define ARENA_KEEP      1024
+
+// Bump allocator for the words of a text request. It is emptied
+// once the request has been serviced.
+struct arena {
+    char *base;
+    size_t used, size;
+};
+
+// Where the parser is in a text request, so that it can carry on
+// when the rest of the line arrives
+struct line_parser {
+    size_t len;         // Bytes of the line seen so far
+    int argc;           // Words finished so far
+    int in_word;
+    int quote;          // The quote we're inside of, or 0
+    int escape;         // The last character was a backslash
+    int raw;            // Taking the rest of the line as is
+    int overflow;       // Over the limit, skipping to the newline
+};
+
+// State of a single client connection
+struct conn {
+    int fd;
+    int authed;
+    int cwd_fd;         // Directory set by "cd", or -1
+    int auth_pending;   // Waiting for the hashing threads
+    int eof;            // The client is done sending
+    int hup;            // The client hung up, so we're out of epoll
+    int proto;          // Protocol version, 1 (text) or 2 (binary)
+    int launching;      // A v2 launch is waiting for its auth
+    int launch_result;  // And this is how the auth went
+    uint32_t events;    // What we're registered for in epoll
+    uid_t uid;          // Of the peer, (uid_t) -1 if unknown
+    gid_t gid;
+    int trusted;        // The policy lets the peer in without a password
+
+    char auth_hash[HASH_LEN + 1];   // Hash being checked by "auth"
+
+    char *in;
+    size_t in_len, in_size;
+
+    struct line_parser line;
+    struct arena words;
+
+    char out[CONN_OUT_SIZE];
+    size_t out_len;
+    // Passed with the byte at out + out_fd_at, if any
+    int out_fds[MAX_PASSED_FDS];
+    int num_out_fds;
+    size_t out_fd_at;
+
+    // Passed by the client for its next v2 request
+    int in_fds[MAX_PASSED_FDS];
+    int num_in_fds;
+
+    pid_t child;        // A direct launch to report the exit of, or 0
+    struct conn *next_waiting;
+};
+
+// Pre-forked worker bookkeeping, shared with the supervisor
+struct worker_slot {
+    pid_t pid;
+    int64_t started;        // On now_ms()'s clock
+    int64_t respawn_at;     // When an empty slot may be filled again
+    int64_t delay;          // Before the next respawn, or 0 for none
+    int conns;              // Connections currently open
+    unsigned long served;   // Connections accepted so far
+};
+
+static int epfd = -1;
+
+// epoll tags for everything which isn't a connection
+static char listen_tag, hashpool_tag, config_tag, child_tag;
+
+// Connections waiting for their direct launch to end
+static struct conn *waiting = NULL;
+
+// The password hash, as last read from the passwd file. It is
+// reread when inotify says the file changed, or on every auth if
+// there is no inotify.
+static char passwd_hash[HASH_LEN + 1];
+static int passwd_loaded = 0;
+static int config_watch = -1;
+
+// Likewise for the policy file
+static int policy_loaded = 0;
+
+// Longest text request accepted, in bytes
+static size_t max_line = PROTO_MAX_MSG;
+
+// PTYs kept ready for launches
+static int pty_pool_size = PTY_POOL_SIZE;
+
+// Number of hashing threads, 0 for one per CPU
+static int auth_threads = 0;
+
+// Our slot in the pool, or NULL when running without workers
+static struct worker_slot *pool_slot = NULL;
 
-int pts_exec(char *dev_name, char **cmd_argv);
+// Exit once this many connections were accepted, 0 for never
+static unsigned long max_requests = 0;
+static unsigned long num_served = 0;
+static int num_conns = 0;
+static int draining = 0;
+
+// Publish our load to the supervisor
+static void update_slot(void) {
+    if (!pool_slot) return;
+    pool_slot->conns = num_conns;
+    pool_slot->served = num_served;
+}
 
 // Initialize signal handlers
 // Returns 0 on success
@@ -51,16 +211,6 @@ int init_signals(void) {
     return 0;
 }
 
-// Restore signal handler behaviour
-void signals_default(void) {
-    struct sigaction act;
-    memset(&act, '\0', sizeof(act));
-    act.sa_handler = SIG_DFL;
-
-    sigaction(SIGPIPE, &act, NULL);
-    sigaction(SIGCHLD, &act, NULL);
-}
-
 // Creates the control socket
 // Returns the socket FD on success, or -1 on failure
 int init_socket(const char *sock_path) {
@@ -68,7 +218,7 @@ int init_socket(const char *sock_path) {
     struct sockaddr_un sck_addr;
 
     // Create the socket
-    sck = socket(AF_UNIX, SOCK_STREAM, 0);
+    sck = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
     if (sck == -1) {
         perror("Failed to open socket");
         return -1;
@@ -91,7 +241,7 @@ int init_socket(const char *sock_path) {
     }
 
     // Attempt to set socket permissions
-    if (chmod(sck_addr.sun_path, S_IRUSR | S_IRGRP | S_IROTH | 
+    if (chmod(sck_addr.sun_path, S_IRUSR | S_IRGRP | S_IROTH |
                     S_IWUSR | S_IWGRP | S_IWOTH) < 0) {
         perror("Warning: unable to set sock permissions");
     }
@@ -99,221 +249,1619 @@ int init_socket(const char *sock_path) {
     return sck;
 }
 
-// Handles password authentication
-// Returns a "boolean" value indicating whether the password matched
-static int service_auth(const char *pwd) {
-    char hash_to_match[61];
-    char *user_hash;
+// Queue a formatted response on the connection. The response
+// is sent by conn_flush()
+static void conn_printf(struct conn *c, const char *fmt, ...) {
+    va_list ap;
+    int ret;
 
-    if (!pwd) pwd = "";
-    
-    // Read the password hash from the passwd file
-    if (load_file(PATH_PREFIX "/passwd", hash_to_match, 60) < 0) {
-        printf("Warning: Unable to read passwd file!\n");
-        return 0;
+    va_start(ap, fmt);
+    ret = vsnprintf(c->out + c->out_len, CONN_OUT_SIZE - c->out_len, fmt, ap);
+    va_end(ap);
+
+    if (ret < 0) return;
+    if ((size_t) ret >= CONN_OUT_SIZE - c->out_len) {
+        // Doesn't fit. Responses are tiny, so the client has
+        // stopped reading. Drop it rather than truncate.
+        printf("[%d] Output buffer full, response dropped\n", c->fd);
+        return;
     }
-    hash_to_match[60] = '\0';
+    c->out_len += ret;
+}
 
-    // Calculate the hash
-    user_hash = bcrypt(pwd, hash_to_match);
-    if (user_hash[0] == ':') {
-        printf("Warning: passwd file contains an invalid hash\n");
-        return 0;
+// What goes back to the client for one request
+struct reply {
+    int ok;
+    const char *msg;
+    const char *ticket;     // Or NULL
+    const char *warning;    // Or NULL. v2 only.
+    pid_t pid;              // Or 0. v2 only.
+    int stage;              // Or 0. v2 only, see PROTO_T_STAGE.
+    int fds[MAX_PASSED_FDS]; // v2 only, descriptors to pass along,
+    int num_fds;            // which conn_reply() takes care of closing
+    uint16_t fds_tag;       // The field saying what they are
+};
+
+static void reply_close_fds(const struct reply *r) {
+    int i;
+
+    for (i = 0; i < r->num_fds; i++) close(r->fds[i]);
+}
+
+// Scratch space for building v2 replies
+static struct proto_buf reply_buf;
+
+// Queues the v2 message in reply_buf
+// Returns -1 if it doesn't fit
+static int conn_queue_msg(struct conn *c) {
+    if (reply_buf.len > CONN_OUT_SIZE - c->out_len) {
+        printf("[%d] Output buffer full, response dropped\n", c->fd);
+        return -1;
     }
+    memcpy(c->out + c->out_len, reply_buf.data, reply_buf.len);
+    c->out_len += reply_buf.len;
+    return 0;
+}
 
-    // Check if it matches
-    if ((strlen(hash_to_match) != strlen(user_hash)) ||
-        (strcmp(hash_to_match, user_hash) != 0)) {
-        return 0;
+// Queue the reply to a request, in the connection's protocol
+static void conn_reply(struct conn *c, const struct reply *r) {
+    if (c->proto < 2) {
+        if (r->ticket) conn_printf(c, "%d %s %s\n", r->ok, r->msg, r->ticket);
+        else conn_printf(c, "%d %s\n", r->ok, r->msg);
+        return;
+    }
+
+    if (proto_begin(&reply_buf, PROTO_REPLY) < 0 ||
+            proto_add_u32(&reply_buf, PROTO_T_STATUS, r->ok) < 0 ||
+            proto_add_str(&reply_buf, PROTO_T_MSG, r->msg) < 0 ||
+            (r->ticket &&
+                proto_add_str(&reply_buf, PROTO_T_TICKET, r->ticket) < 0) ||
+            (r->pid &&
+                proto_add_u32(&reply_buf, PROTO_T_PID, r->pid) < 0) ||
+            (r->warning &&
+                proto_add_str(&reply_buf, PROTO_T_WARNING, r->warning) < 0) ||
+            (r->stage &&
+                proto_add_u32(&reply_buf, PROTO_T_STAGE, r->stage) < 0) ||
+            (r->num_fds &&
+                proto_add(&reply_buf, r->fds_tag, "", 0) < 0)) {
+        printf("[%d] Out of memory, response dropped\n", c->fd);
+        reply_close_fds(r);
+        return;
+    }
+    proto_end(&reply_buf);
+
+    if (r->num_fds && c->num_out_fds) {
+        printf("[%d] Output buffer full, response dropped\n", c->fd);
+        reply_close_fds(r);
+        return;
+    }
+    if (conn_queue_msg(c) < 0) {
+        reply_close_fds(r);
+        return;
+    }
+    if (r->num_fds) {
+        memcpy(c->out_fds, r->fds, sizeof(*r->fds) * r->num_fds);
+        c->num_out_fds = r->num_fds;
+        c->out_fd_at = c->out_len - reply_buf.len;
+    }
+}
+
+// Tells a direct launch's client how its command ended
+static void conn_exit(struct conn *c, int status) {
+    if (proto_begin(&reply_buf, PROTO_EXIT) < 0 ||
+            (WIFSIGNALED(status) ?
+                proto_add_u32(&reply_buf, PROTO_T_SIGNAL, WTERMSIG(status)) :
+                proto_add_u32(&reply_buf, PROTO_T_EXIT, WEXITSTATUS(status))) < 0) {
+        printf("[%d] Out of memory, exit status dropped\n", c->fd);
+        return;
     }
+    proto_end(&reply_buf);
+    conn_queue_msg(c);
+}
 
-    return 1;
+// Queue r as a failure with the given message
+static void conn_fail(struct conn *c, struct reply *r, const char *msg) {
+    r->ok = 0;
+    r->msg = msg;
+    conn_reply(c, r);
 }
 
-#define EXEC_MAX_ARGS   32
-static void service_exec(FILE *fp, char *arg) {
-    char *pts, *tmp, *argv[EXEC_MAX_ARGS + 1];
-    pid_t pid;
-    int i;
+// Queue a reply which is just a status and a message
+static void conn_status(struct conn *c, int ok, const char *msg) {
+    struct reply r;
+
+    memset(&r, '\0', sizeof(r));
+    r.ok = ok;
+    r.msg = msg;
+    conn_reply(c, &r);
+}
+
+// Update the events we are interested in for this connection.
+// While a response is stuck we stop reading new requests, and
+// while a password is being checked we don't read at all.
+static void conn_update_events(struct conn *c) {
+    struct epoll_event ev;
+    uint32_t events;
+
+    if (c->hup) return;
 
-    // Parse the TTY device path
-    pts = strtok(arg, " ");
-    tmp = strtok(NULL, " ");
+    if (c->out_len) events = EPOLLOUT;
+    else if (c->auth_pending || c->eof) events = 0;
+    else events = EPOLLIN;
 
-    // Parse argv
-    if (!tmp) {
-        fprintf(fp, "0 No file specified\n");
+    if (c->events == events) return;
+
+    ev.events = events;
+    ev.data.ptr = c;
+    if (epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev) < 0) {
+        perror("epoll_ctl(MOD) failed");
         return;
     }
+    c->events = events;
+}
+
+// Sends as much of the pending output as the socket will take
+// Returns -1 if the connection should be dropped
+static int conn_flush(struct conn *c) {
+    ssize_t ret;
+
+    while (c->out_len) {
+        if (!c->num_out_fds) {
+            ret = write(c->fd, c->out, c->out_len);
+        } else if (c->out_fd_at) {
+            // What comes before the descriptors' reply goes on its own
+            ret = write(c->fd, c->out, c->out_fd_at);
+        } else {
+            ret = send_fds(c->fd, c->out, c->out_len,
+                    c->out_fds, c->num_out_fds);
+        }
+        if (ret < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            return -1;
+        }
+
+        if (c->num_out_fds) {
+            if (c->out_fd_at) {
+                c->out_fd_at -= ret;
+            } else {
+                // They're the client's now
+                while (c->num_out_fds) close(c->out_fds[--c->num_out_fds]);
+            }
+        }
+
+        memmove(c->out, c->out + ret, c->out_len - ret);
+        c->out_len -= ret;
+    }
+
+    conn_update_events(c);
+    return 0;
+}
+
+// Closes whatever the client passed and no request took
+static void conn_drop_fds(struct conn *c) {
+    while (c->num_in_fds) close(c->in_fds[--c->num_in_fds]);
+}
 
-    argv[0] = tmp;
-    for (i = 1; i < EXEC_MAX_ARGS; i++) {
-        argv[i] = strtok(NULL, " ");
-        if (!argv[i]) {
-            i = -1;
+// Stops waiting for the connection's direct launch
+static void conn_unwait(struct conn *c) {
+    struct conn **pp;
+
+    for (pp = &waiting; *pp; pp = &(*pp)->next_waiting) {
+        if (*pp == c) {
+            *pp = c->next_waiting;
             break;
         }
     }
+    c->child = 0;
+}
+
+static void conn_close(struct conn *c) {
+    if (c->auth_pending) hashpool_cancel(c);
+    epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    if (c->cwd_fd >= 0) close(c->cwd_fd);
+    while (c->num_out_fds) close(c->out_fds[--c->num_out_fds]);
+    conn_drop_fds(c);
+
+    // The client is gone, so its command has lost its terminal too
+    if (c->child) {
+        kill(c->child, SIGHUP);
+        conn_unwait(c);
+    }
+
+    printf("[%d] Connection closed\n", c->fd);
+    free(c->in);
+    free(c->words.base);
+    free(c);
+
+    num_conns--;
+    update_slot();
+}
+
+// Gets the password hash, from the passwd file if need be
+// Returns -1 on failure
+static int load_hash(char hash[HASH_LEN + 1]) {
+    if (!passwd_loaded || config_watch < 0) {
+        memset(passwd_hash, '\0', sizeof(passwd_hash));
+        if (load_file(PATH_PREFIX "/passwd", passwd_hash, HASH_LEN) < 0) {
+            printf("Warning: Unable to read passwd file!\n");
+            return -1;
+        }
+        passwd_loaded = 1;
+    }
+
+    memcpy(hash, passwd_hash, sizeof(passwd_hash));
+    return 0;
+}
+
+// Watches PATH_PREFIX for files being replaced or rewritten
+// Returns the inotify FD, or -1 if we'll have to do without
+static int init_config_watch(void) {
+    int fd;
+
+    fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd < 0) {
+        perror("Warning: inotify_init1() failed");
+        return -1;
+    }
+
+    if (inotify_add_watch(fd, PATH_PREFIX,
+                IN_CLOSE_WRITE | IN_MOVED_TO | IN_DELETE) < 0) {
+        perror("Warning: Unable to watch " PATH_PREFIX);
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+// Something in PATH_PREFIX changed. Forget what we cached from it.
+static void config_changed(void) {
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    struct inotify_event *ev;
+    ssize_t len;
+    char *p;
+
+    while ((len = read(config_watch, buf, sizeof(buf))) > 0) {
+        for (p = buf; p < buf + len; p += sizeof(*ev) + ev->len) {
+            ev = (struct inotify_event *) p;
+            if (!ev->len) continue;
+            if (strcmp(ev->name, "passwd") == 0) passwd_loaded = 0;
+            if (strcmp(ev->name, "policy") == 0) policy_loaded = 0;
+        }
+    }
 
-    // Sorry, we don't have enough buffers for argv
-    if (i != -1 && (argv[EXEC_MAX_ARGS] = strtok(NULL, " "))) {
-        fprintf(fp, "0 Too many arguments in command\n");
+    if (len < 0 && errno != EAGAIN && errno != EINTR) {
+        perror("Warning: Unable to read inotify events");
+    }
+}
+
+// Handles password authentication. The password is checked by
+// the hashing threads; the result arrives in auth_done().
+static void service_auth(struct conn *c, const char *pwd) {
+    if (!pwd) pwd = "";
+
+    // Nothing to check for trusted peers
+    if (c->trusted) {
+        conn_status(c, 1, "Auth OK");
         return;
     }
 
-    // Fork
-    pid = fork();
-    if (pid == -1) {
-        fprintf(fp, "0 Failed to fork");
+    // A new attempt revokes the old one
+    c->authed = 0;
+
+    if (load_hash(c->auth_hash) < 0) {
+        conn_status(c, 0, "Auth failed");
         return;
     }
-    if (pid > 0) {
-        // In parent
-        fprintf(fp, "1 Child launched with PID = %d\n", pid);
+
+    if (hashpool_submit(c, pwd, c->auth_hash) < 0) {
+        conn_status(c, 0, "Server busy");
         return;
     }
-    
-    // In child
-    signals_default();
 
-    // Exec!
-    pts_exec(pts, argv);
-    printf("Warning: pts_exec failed\n");
-    exit(EXIT_FAILURE);
+    c->auth_pending = 1;
 }
 
-// Handles a single connection. Will fork and close the FD
-// in the parent
-void service_main(int sck) {
-    pid_t pid;
-    int authed;
-    FILE *fp;
-    char buf[128];
+// Authentication with a ticket from an earlier "auth"
+static void service_ticket(struct conn *c, const char *ticket) {
+    char hash[HASH_LEN + 1];
 
-    pid = fork();
-    if (pid < 0) {
-        perror("service_handler(): Could not fork");
+    if (!ticket) ticket = "";
+
+    if (c->trusted) {
+        conn_status(c, 1, "Auth OK");
         return;
-    } else if (pid > 0) {
-        // In parent
-        close(sck);
+    }
+
+    // A new attempt revokes the old one
+    c->authed = 0;
+
+    if (c->uid == (uid_t) -1 || load_hash(hash) < 0 ||
+            ticket_check(ticket, c->uid, hash) < 0) {
+        conn_status(c, 0, "Ticket rejected");
         return;
     }
 
-    // In child
-    authed = 0;
-    pid = getpid();
+    c->authed = 1;
+    conn_status(c, 1, "Auth OK");
+}
 
-    // Turn our socket operations into buffered I/O
-    fp = fdopen(sck, "w+");
-    if (!fp) {
-        perror("fdopen failed");
-        close(sck);
-        exit(EXIT_FAILURE);
+// Tells the client whether it may skip authentication, so that
+// it doesn't ask the user for a password it doesn't need
+static void service_peer(struct conn *c) {
+    if (c->trusted) {
+        conn_status(c, 1, "Trusted");
+    } else {
+        conn_status(c, 0, "Password required");
     }
+}
 
-    // Service loop
-    printf("[%d] Starting service loop\n", pid);
-    while(1) {
-        char *line = fgets(buf, 128, fp);
-        char *cmd, *arg;
+// Change Directory. The directory is only opened here; the
+// daemon itself never changes directory, the launched child does.
+static void service_cd(struct conn *c, const char *arg) {
+    int fd;
 
-        if (!line) break;
+    if (!arg) arg = "";
 
-        // Parse the command
-        cmd = strtok(line, " ");
-        arg = strtok(NULL, "\n");
+    fd = open(arg, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        conn_status(c, 0, "Change directory failed");
+        return;
+    }
 
-        if (strcmp(cmd, "auth") == 0) {
-            authed = service_auth(arg);
-            if (authed) {
-                fprintf(fp, "1 Auth OK\n");
-            } else {
-                fprintf(fp, "0 Auth failed\n");
-            }
+    if (c->cwd_fd >= 0) close(c->cwd_fd);
+    c->cwd_fd = fd;
+    conn_status(c, 1, "Change directory OK");
+}
 
-            continue;
+// Starts the command on three new pipes, and puts the other ends
+// in r to go back to the client
+// Returns the PID, or -1 with failed set
+static pid_t pipe_spawn(char **argv, char **env, int cwd_fd,
+        struct reply *r, const char **failed) {
+    int p[3][2], stdio[3], i, n, out, saved;
+    pid_t pid = -1;
+
+    for (n = 0; n < 3; n++) {
+        if (pipe2(p[n], O_CLOEXEC) < 0) {
+            *failed = "Unable to create pipes";
+            break;
         }
+    }
 
-        if (!authed) {
-            // Don't entertain anything else if not authorized
-            fprintf(fp, "0 Not authorized\n");
-        } else {
-            // Change Directory
-            if (strcmp(cmd, "cd") == 0) {
-                if (chdir(arg) == 0) {
-                    fprintf(fp, "1 Change directory OK\n");
-                } else {
-                    fprintf(fp, "0 Change directory failed\n");
-                }
+    // The command reads stdin and writes the others
+    if (n == 3) {
+        for (i = 0; i < 3; i++) stdio[i] = p[i][i > 0];
+        pid = fd_spawn(stdio, argv, env, cwd_fd, failed);
+    }
 
-            // EXEC
-            } else if (strcmp(cmd, "exec") == 0) {
-                service_exec(fp, arg);
+    saved = errno;
+    for (i = 0; i < n; i++) {
+        out = i > 0;
+        close(p[i][out]);
+        if (pid == -1) close(p[i][!out]);
+        else r->fds[i] = p[i][!out];
+    }
+    if (pid != -1) {
+        r->num_fds = 3;
+        r->fds_tag = PROTO_T_PIPES;
+    }
+    errno = saved;
 
-            // Unknown command
-            } else {
-                fprintf(fp, "0 Bad command\n");
+    return pid;
+}
+
+// Starts the command in the connection's directory, on the PTS
+// named by the client, or if there's none, on one of ours which is
+// then passed back. A direct launch runs on the client's own
+// descriptors instead, and a pipe launch on pipes of ours. env
+// entries are added to the daemon's environment. tio and ws may be
+// NULL. flags are the request's PROTO_F_*. r is filled in and sent
+// as the reply.
+static void launch(struct conn *c, const char *pts, char **argv, char **env,
+        const struct termios *tio, const struct winsize *ws,
+        uint32_t flags, struct reply *r) {
+    const char *failed = NULL;
+    int ptm = -1, pts_fd;
+    char msg[128];
+    pid_t pid;
+
+    if (flags & (PROTO_F_DIRECT | PROTO_F_PIPES)) {
+        if (c->child) {
+            conn_fail(c, r, "A command is running already");
+            return;
+        }
 
+        if (flags & PROTO_F_DIRECT) {
+            // stdin, stdout, stderr and the directory
+            if (c->num_in_fds != 4) {
+                conn_fail(c, r, "Descriptors missing");
+                return;
             }
+            pid = fd_spawn(c->in_fds, argv, env, c->in_fds[3], &failed);
+        } else {
+            pid = pipe_spawn(argv, env, c->cwd_fd, r, &failed);
+        }
+        if (pid == -1) {
+            snprintf(msg, sizeof(msg), "%s: %s", failed, strerror(errno));
+            conn_fail(c, r, msg);
+            return;
+        }
+
+        // Its exit goes to the client after the reply
+        c->child = pid;
+        c->next_waiting = waiting;
+        waiting = c;
+
+        snprintf(msg, sizeof(msg), "Child launched with PID = %d", pid);
+        r->ok = 1;
+        r->msg = msg;
+        r->pid = pid;
+        conn_reply(c, r);
+        return;
+    }
+
+    // A warm session saves starting one, if the client can take it
+    if (flags & PROTO_F_TAKE_PTY) {
+        ptm = zygote_take(argv, env, c->cwd_fd, ws, &pid);
+        if (ptm >= 0) {
+            snprintf(msg, sizeof(msg), "Warm session with PID = %d", pid);
+            r->ok = 1;
+            r->msg = msg;
+            r->pid = pid;
+            r->fds[0] = ptm;
+            r->num_fds = 1;
+            r->fds_tag = PROTO_T_PTM;
+            conn_reply(c, r);
+            return;
         }
     }
 
-    fclose(fp);
-    printf("[%d] Child exited\n", pid);
-    exit(EXIT_SUCCESS);
+    if (pts) {
+        pts_fd = open(pts, O_RDWR | O_NOCTTY | O_CLOEXEC);
+        if (pts_fd < 0) failed = "Failed to open PTS device";
+    } else if (flags & PROTO_F_TAKE_PTY) {
+        ptm = ptypool_take(&pts_fd);
+        if (ptm < 0) failed = "Unable to open a PTY";
+    } else {
+        conn_fail(c, r, "No PTS specified");
+        return;
+    }
+
+    // The only process created on the request path. It shares our
+    // memory until it execs, so the daemon's size doesn't matter.
+    if (!failed) {
+        pid = pts_spawn(pts_fd, argv, env, c->cwd_fd, tio, ws, &failed);
+        close(pts_fd);
+        if (pid == -1 && !failed) failed = "Failed to launch";
+    }
+
+    if (failed) {
+        snprintf(msg, sizeof(msg), "%s: %s", failed, strerror(errno));
+        if (ptm >= 0) close(ptm);
+        conn_fail(c, r, msg);
+        return;
+    }
+
+    snprintf(msg, sizeof(msg), "Child launched with PID = %d", pid);
+    r->ok = 1;
+    r->msg = msg;
+    r->pid = pid;
+    if (ptm >= 0) {
+        r->fds[0] = ptm;
+        r->num_fds = 1;
+        r->fds_tag = PROTO_T_PTM;
+    }
+    conn_reply(c, r);
 }
 
-// Daemon entry point
-int pts_daemon_main(int argc, char *argv[]) {
-    int sck;
-    struct pollfd pfd;
-    
-    if (argc > 1 && (strcmp(argv[1], "-D") == 0)) {
-        daemonize();
+// Handles "exec <pts> <file> [args...]"
+static void service_exec(struct conn *c, int argc, char **argv) {
+    struct reply r;
+
+    if (argc < 3) {
+        conn_status(c, 0, "No file specified");
+        return;
     }
 
-    if (check_path(PATH_PREFIX)) return -1; 
+    memset(&r, '\0', sizeof(r));
+    launch(c, argv[1], argv + 2, NULL, NULL, NULL, 0, &r);
+}
 
-    // Initialization
-    printf("Initializing daemon\n");
-    if (init_signals()) return -1;
+// v2 launch. Strings are used where they lie in the input buffer,
+// only the argv and env arrays are allocated. r holds anything
+// else that goes into the reply.
+static void service_exec_v2(struct conn *c, const char *body, uint32_t len,
+        struct reply *r) {
+    const char *pts = NULL, *str;
+    struct termios tio, *tiop = NULL;
+    struct winsize ws, *wsp = NULL;
+    char **argv = NULL, **env = NULL;
+    int argc = 0, envc = 0, ret, fd;
+    uint32_t off = 0, flags = 0;
+    struct proto_field f;
 
-    sck = init_socket("/dev/pts-daemon");
-    if (sck < 0) {
-        return -1;
+    // Count the arrays first
+    while ((ret = proto_next(body, len, &off, &f)) > 0) {
+        if (f.tag == PROTO_T_ARG) argc++;
+        else if (f.tag == PROTO_T_ENV) envc++;
+    }
+    if (ret < 0) {
+        conn_fail(c, r, "Malformed request");
+        return;
+    }
+    if (!argc) {
+        conn_fail(c, r, "No file specified");
+        return;
     }
 
-    // Main server loop
-    pfd.fd = sck;
-    pfd.events = POLLIN;
+    argv = calloc(argc + 1, sizeof(*argv));
+    env = calloc(envc + 1, sizeof(*env));
+    if (!argv || !env) {
+        conn_fail(c, r, "Out of memory");
+        goto out;
+    }
 
-    printf("Entering main loop\n");
-    listen(sck, 2);
+    argc = envc = 0;
+    off = 0;
+    while (proto_next(body, len, &off, &f) > 0) {
+        switch (f.tag) {
+            case PROTO_T_PTS:
+                pts = proto_str(&f);
+                if (!pts) goto malformed;
+                break;
+            case PROTO_T_ARG:
+                if (!(argv[argc++] = (char *) proto_str(&f))) goto malformed;
+                break;
+            case PROTO_T_ENV:
+                if (!(env[envc++] = (char *) proto_str(&f))) goto malformed;
+                break;
+            case PROTO_T_CWD:
+                if (!(str = proto_str(&f))) goto malformed;
+                fd = open(str, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+                if (fd < 0) {
+                    r->warning = "Unable to change directory";
+                    break;
+                }
+                if (c->cwd_fd >= 0) close(c->cwd_fd);
+                c->cwd_fd = fd;
+                break;
+            case PROTO_T_TERMIOS:
+                if (f.len != sizeof(tio)) goto malformed;
+                memcpy(&tio, f.val, sizeof(tio));
+                tiop = &tio;
+                break;
+            case PROTO_T_WINSIZE:
+                if (f.len != sizeof(ws)) goto malformed;
+                memcpy(&ws, f.val, sizeof(ws));
+                wsp = &ws;
+                break;
+            case PROTO_T_FLAGS:
+                flags = proto_u32(&f, 0);
+                break;
+            default:
+                // Ignore what we don't know, for newer clients
+                break;
+        }
+    }
 
-    while(1) {
-        int ret;
+    launch(c, pts, argv, env, tiop, wsp, flags, r);
+    goto out;
 
-        // Poll for incoming connections
-        pfd.revents = 0;
-        ret = poll(&pfd, 1, -1);
+malformed:
+    conn_fail(c, r, "Malformed request");
+out:
+    free(argv);
+    free(env);
+}
+
+// Authenticates and launches in one go. The first pass may have
+// to wait for the hashing threads, in which case it returns -1
+// and is called again with the same message once the password
+// has been checked. Returns 0 once answered.
+static int service_launch(struct conn *c, const char *body, uint32_t len) {
+    const char *pwd = NULL, *ticket = NULL;
+    char hash[HASH_LEN + 1], new_ticket[TICKET_SPACE];
+    struct proto_field f;
+    uint32_t off = 0;
+    struct reply r;
+    int ret;
+
+    memset(&r, '\0', sizeof(r));
+    r.stage = PROTO_STAGE_AUTH;
+
+    if (c->launching) {
+        // Second pass, the password has been checked
+        c->launching = 0;
+        c->authed = (c->launch_result == HASH_MATCH);
+        if (!c->authed) {
+            conn_fail(c, &r, "Auth failed");
+            return 0;
+        }
+        if (c->uid != (uid_t) -1 && ticket_issue(c->uid, c->auth_hash,
+                    new_ticket, sizeof(new_ticket)) == 0) {
+            r.ticket = new_ticket;
+        }
+    } else if (!c->trusted) {
+        while ((ret = proto_next(body, len, &off, &f)) > 0) {
+            if (f.tag == PROTO_T_PASSWORD) pwd = proto_str(&f);
+            else if (f.tag == PROTO_T_TICKET) ticket = proto_str(&f);
+        }
         if (ret < 0) {
-            perror("poll() failed in main loop");
-            return -1;
+            conn_fail(c, &r, "Malformed request");
+            return 0;
         }
 
-        if (pfd.revents & POLLIN) {
-            int chd_sck;
-            // Incoming connection
-            chd_sck = accept(sck, NULL, NULL);
-            if (chd_sck < 0) {
-                perror("accept() failed in main loop");
-                return -1;
+        // Credentials replace whatever was there, like "auth" does.
+        // A good ticket saves the bcrypt.
+        if (pwd || ticket) c->authed = 0;
+        if (ticket && c->uid != (uid_t) -1 && load_hash(hash) == 0 &&
+                ticket_check(ticket, c->uid, hash) == 0) {
+            c->authed = 1;
+        } else if (pwd) {
+            if (load_hash(c->auth_hash) < 0) {
+                conn_fail(c, &r, "Auth failed");
+                return 0;
+            }
+            if (hashpool_submit(c, pwd, c->auth_hash) < 0) {
+                conn_fail(c, &r, "Server busy");
+                return 0;
             }
+            c->auth_pending = 1;
+            c->launching = 1;
+            return -1;
+        }
+
+        if (!c->authed) {
+            conn_fail(c, &r, ticket ? "Ticket rejected" : "Not authorized");
+            return 0;
+        }
+    }
+
+    r.stage = PROTO_STAGE_EXEC;
+    service_exec_v2(c, body, len, &r);
+    return 0;
+}
+
+// Handles a single request line
+static void service_line(struct conn *c, int argc, char **argv) {
+    char *cmd, *arg;
+
+    if (!argc) {
+        conn_status(c, 0, "Bad command");
+        return;
+    }
+    cmd = argv[0];
+    arg = argv[1];
+
+    if (strcmp(cmd, "auth") == 0) {
+        service_auth(c, arg);
+        return;
+    }
+
+    if (strcmp(cmd, "ticket") == 0) {
+        service_ticket(c, arg);
+        return;
+    }
+
+    if (strcmp(cmd, "peer") == 0) {
+        service_peer(c);
+        return;
+    }
+
+    // Everything after this line is binary
+    if (strcmp(cmd, PROTO_V2_HELLO) == 0) {
+        conn_status(c, 1, PROTO_V2_HELLO);
+        c->proto = 2;
+        return;
+    }
+
+    if (!c->authed) {
+        // Don't entertain anything else if not authorized
+        conn_status(c, 0, "Not authorized");
+    } else {
+        // Change Directory
+        if (strcmp(cmd, "cd") == 0) {
+            service_cd(c, arg);
+
+        // EXEC
+        } else if (strcmp(cmd, "exec") == 0) {
+            service_exec(c, argc, argv);
+
+        // Unknown command
+        } else {
+            conn_status(c, 0, "Bad command");
+
+        }
+    }
+}
 
-            service_main(chd_sck);
+// Services one v2 message
+// Returns -1 if it has to be looked at again later
+static int service_msg(struct conn *c, uint16_t type, char *body,
+        uint32_t len) {
+    struct reply r;
+    struct proto_field f;
+    const char *str = NULL;
+    uint32_t off = 0;
+    int ret;
+
+    // Requests with a single string argument
+    if (type == PROTO_AUTH || type == PROTO_TICKET) {
+        while ((ret = proto_next(body, len, &off, &f)) > 0) {
+            if (f.tag == (type == PROTO_AUTH ? PROTO_T_PASSWORD :
+                        PROTO_T_TICKET)) {
+                str = proto_str(&f);
+            }
         }
+        if (ret < 0 || !str) {
+            conn_status(c, 0, "Malformed request");
+            return 0;
+        }
+    }
+
+    switch (type) {
+        case PROTO_AUTH: service_auth(c, str); return 0;
+        case PROTO_TICKET: service_ticket(c, str); return 0;
+        case PROTO_PEER: service_peer(c); return 0;
+        case PROTO_LAUNCH: return service_launch(c, body, len);
     }
 
+    if (!c->authed) {
+        conn_status(c, 0, "Not authorized");
+    } else if (type == PROTO_EXEC) {
+        memset(&r, '\0', sizeof(r));
+        service_exec_v2(c, body, len, &r);
+    } else {
+        conn_status(c, 0, "Bad command");
+    }
     return 0;
 }
+
+// Services the v2 message at buf, if it's all there
+// Returns the number of bytes used, or 0 if more are needed
+static size_t service_v2(struct conn *c, char *buf, size_t left) {
+    struct proto_hdr hdr;
+    size_t need;
+    char *in;
+
+    if (left < sizeof(hdr)) return 0;
+    memcpy(&hdr, buf, sizeof(hdr));
+
+    if (hdr.len > PROTO_MAX_MSG) {
+        // No way of resyncing. Say so, then hang up.
+        conn_status(c, 0, "Request too long");
+        c->eof = 1;
+        return left;
+    }
+
+    need = sizeof(hdr) + hdr.len;
+    if (left < need) {
+        // Make room for the rest of it
+        if (need > c->in_size) {
+            in = realloc(c->in, need);
+            if (!in) {
+                conn_status(c, 0, "Out of memory");
+                c->eof = 1;
+                return left;
+            }
+            c->in = in;
+            c->in_size = need;
+        }
+        return 0;
+    }
+
+    // Leave it in the buffer if it isn't done with yet
+    if (service_msg(c, hdr.type, buf + sizeof(hdr), hdr.len) < 0) return 0;
+    conn_drop_fds(c);
+    return need;
+}
+
+// Makes room for n more bytes in the arena
+// Returns 0 on success, -1 if out of memory
+static int arena_reserve(struct arena *a, size_t n) {
+    size_t size = a->size ? a->size : 64;
+    char *base;
+
+    if (a->used + n <= a->size) return 0;
+    while (size < a->used + n) size *= 2;
+
+    base = realloc(a->base, size);
+    if (!base) return -1;
+    a->base = base;
+    a->size = size;
+    return 0;
+}
+
+// Empties the arena, giving back what an unusually long
+// request took
+static void arena_reset(struct arena *a) {
+    a->used = 0;
+    if (a->size > ARENA_KEEP) {
+        free(a->base);
+        a->base = NULL;
+        a->size = 0;
+    }
+}
+
+// Commands which take the rest of the line as their argument,
+// exactly as sent. Passwords and paths go through untouched.
+static int takes_rest(const char *cmd) {
+    return strcmp(cmd, "auth") == 0 || strcmp(cmd, "ticket") == 0 ||
+        strcmp(cmd, "cd") == 0;
+}
+
+// Adds a character to the word being parsed
+static int word_add(struct conn *c, char ch) {
+    if (arena_reserve(&c->words, 1) < 0) return -1;
+    c->words.base[c->words.used++] = ch;
+    c->line.in_word = 1;
+    return 0;
+}
+
+// Terminates the word being parsed
+static int word_end(struct conn *c) {
+    if (word_add(c, '\0') < 0) return -1;
+    c->line.in_word = 0;
+    c->line.argc++;
+
+    // The command's been named. See how it wants the rest.
+    if (c->line.argc == 1 && takes_rest(c->words.base)) {
+        c->line.raw = 1;
+        c->line.in_word = 1;
+    }
+    return 0;
+}
+
+// Feeds one character of a text request to the parser
+// Returns -1 if out of memory
+static int parse_char(struct conn *c, char ch) {
+    struct line_parser *p = &c->line;
+
+    if (p->raw) return word_add(c, ch);
+
+    if (p->escape) {
+        p->escape = 0;
+        return word_add(c, ch);
+    }
+
+    if (p->quote) {
+        if (ch == p->quote) {
+            p->quote = 0;
+        } else if (ch == '\\' && p->quote == '"') {
+            p->escape = 1;
+        } else {
+            return word_add(c, ch);
+        }
+        return 0;
+    }
+
+    switch (ch) {
+        case ' ':
+        case '\t':
+            if (p->in_word) return word_end(c);
+            return 0;
+
+        case '\'':
+        case '"':
+            // Even "" makes a word
+            p->quote = ch;
+            p->in_word = 1;
+            return 0;
+
+        case '\\':
+            p->escape = 1;
+            p->in_word = 1;
+            return 0;
+
+        default:
+            return word_add(c, ch);
+    }
+}
+
+// The newline's in. Builds argv in the arena and services it.
+static void parse_done(struct conn *c) {
+    struct line_parser *p = &c->line;
+    size_t off, align;
+    char **argv;
+    int i;
+
+    if (p->overflow) {
+        // Already answered
+
+    } else if (p->quote || p->escape) {
+        conn_status(c, 0, "Unterminated quote");
+
+    } else if (p->in_word && word_end(c) < 0) {
+        conn_status(c, 0, "Out of memory");
+
+    } else {
+        // Nothing after the command is the same as no argument
+        if (p->raw && c->words.base[c->words.used - 1] == '\0' &&
+                c->words.base[c->words.used - 2] == '\0') {
+            p->argc--;
+        }
+
+        align = -c->words.used & (sizeof(char *) - 1);
+        if (arena_reserve(&c->words, align + (p->argc + 1) * sizeof(char *)) < 0) {
+            conn_status(c, 0, "Out of memory");
+        } else {
+            argv = (char **) (c->words.base + c->words.used + align);
+            for (i = 0, off = 0; i < p->argc; i++) {
+                argv[i] = c->words.base + off;
+                off += strlen(argv[i]) + 1;
+            }
+            argv[i] = NULL;
+
+            service_line(c, p->argc, argv);
+        }
+    }
+
+    memset(p, '\0', sizeof(*p));
+    arena_reset(&c->words);
+}
+
+// Parses text requests from buf, servicing each one as its
+// newline arrives. What's left of an unfinished line is kept in
+// the parser, not the input buffer.
+// Returns the number of bytes used.
+static size_t service_v1(struct conn *c, char *buf, size_t left) {
+    struct line_parser *p = &c->line;
+    size_t i;
+
+    for (i = 0; i < left; i++) {
+        if (buf[i] == '\n') {
+            parse_done(c);
+            return i + 1;
+        }
+
+        if (p->overflow) continue;
+
+        if (++p->len > max_line) {
+            // Tell the client once, then skip to the end of the line
+            conn_status(c, 0, "Request too long");
+            p->overflow = 1;
+        } else if (parse_char(c, buf[i]) < 0) {
+            conn_status(c, 0, "Out of memory");
+            p->overflow = 1;
+        }
+    }
+
+    return left;
+}
+
+// Services every complete request in the input buffer
+static void service_input(struct conn *c) {
+    size_t used = 0, n;
+
+    // Requests are handled in order, so nothing after an
+    // auth is looked at until the password has been checked
+    while (!c->auth_pending && used < c->in_len) {
+        if (c->proto < 2) n = service_v1(c, c->in + used, c->in_len - used);
+        else n = service_v2(c, c->in + used, c->in_len - used);
+        if (!n) break;
+        used += n;
+    }
+
+    memmove(c->in, c->in + used, c->in_len - used);
+    c->in_len -= used;
+}
+
+// Reads everything available on the connection
+// Returns -1 if the connection should be dropped
+static int conn_read(struct conn *c) {
+    ssize_t ret;
+
+    while (!c->auth_pending && !c->eof) {
+        ret = recv_fds(c->fd, c->in + c->in_len, c->in_size - c->in_len,
+                c->in_fds, &c->num_in_fds, MAX_PASSED_FDS);
+        if (ret < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            return -1;
+        }
+
+        // EOF. Finish off what was already sent first.
+        if (ret == 0) {
+            c->eof = 1;
+            return 0;
+        }
+
+        c->in_len += ret;
+        service_input(c);
+
+        // Stop reading while responses are backed up
+        if (c->out_len) return 0;
+    }
+
+    return 0;
+}
+
+// Sends what's pending, and closes the connection once there
+// is nothing left to do on it
+static void conn_settle(struct conn *c) {
+    while (1) {
+        if (conn_flush(c) < 0) {
+            if (!c->hup) {
+                conn_close(c);
+                return;
+            }
+
+            // Nobody is left to read it
+            c->out_len = 0;
+            while (c->num_out_fds) close(c->out_fds[--c->num_out_fds]);
+        }
+
+        // After a hangup, epoll no longer says when to read. Carry
+        // on with what the client sent, until it's all read or a
+        // request has to wait.
+        if (!c->hup || c->eof || c->auth_pending || c->out_len) break;
+        conn_read(c);
+        if (!c->auth_pending && !c->out_len) c->eof = 1;
+    }
+
+    if (c->eof && !c->auth_pending && !c->out_len && !c->child) {
+        conn_close(c);
+    }
+}
+
+// Handles readiness of a client connection
+static void conn_event(struct conn *c, uint32_t events) {
+    if (events & EPOLLERR) {
+        conn_close(c);
+        return;
+    }
+
+    if (events & EPOLLHUP) {
+        // Still carry out what the client sent before hanging up,
+        // such as an exec queued behind an auth. epoll would keep
+        // reporting the hangup, so stop watching the socket.
+        c->hup = 1;
+        epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+        conn_settle(c);
+        return;
+    }
+
+    if ((events & EPOLLIN) && conn_read(c) < 0) {
+        conn_flush(c);
+        conn_close(c);
+        return;
+    }
+
+    conn_settle(c);
+}
+
+// A password check finished. Answer it, then carry on with
+// whatever the client sent after the auth. A successful auth
+// comes with a ticket, if the peer's uid is known.
+static void auth_done(void *owner, int result) {
+    char ticket[TICKET_SPACE];
+    struct conn *c = owner;
+    struct reply r;
+
+    c->auth_pending = 0;
+
+    if (result == HASH_BAD) {
+        printf("Warning: passwd file contains an invalid hash\n");
+    }
+
+    // A launch picks up where it left off
+    if (c->launching) {
+        c->launch_result = result;
+        service_input(c);
+        conn_settle(c);
+        return;
+    }
+
+    c->authed = (result == HASH_MATCH);
+
+    memset(&r, '\0', sizeof(r));
+    r.ok = c->authed;
+    r.msg = c->authed ? "Auth OK" : "Auth failed";
+    if (c->authed && c->uid != (uid_t) -1 &&
+            ticket_issue(c->uid, c->auth_hash, ticket, sizeof(ticket)) == 0) {
+        r.ticket = ticket;
+    }
+    conn_reply(c, &r);
+
+    service_input(c);
+    conn_settle(c);
+}
+
+// Looks the peer up in the policy, reading it first if need be
+static int check_peer(uid_t uid, gid_t gid) {
+    if (!policy_loaded || config_watch < 0) {
+        if (policy_load(PATH_PREFIX "/policy") == 0) policy_loaded = 1;
+    }
+
+    return policy_check(uid, gid);
+}
+
+// Accepts all pending connections
+static void accept_conns(int sck) {
+    struct epoll_event ev;
+    struct ucred cred;
+    socklen_t len;
+    struct conn *c;
+    int fd, policy;
+
+    while (!draining) {
+        fd = accept4(sck, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("accept() failed in main loop");
+            }
+            return;
+        }
+
+        // Who's on the other end, for the policy and tickets
+        len = sizeof(cred);
+        if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0) {
+            cred.uid = (uid_t) -1;
+            cred.gid = (gid_t) -1;
+            policy = POLICY_PASSWORD;
+        } else {
+            policy = check_peer(cred.uid, cred.gid);
+        }
+
+        // Turn strangers away before they cost us anything
+        if (policy == POLICY_DENY) {
+            printf("[%d] Denied uid %d, gid %d\n", fd,
+                    (int) cred.uid, (int) cred.gid);
+            write_to_fd(fd, (unsigned char *) "0 Access denied\n", 16);
+            close(fd);
+            continue;
+        }
+
+        c = calloc(1, sizeof(*c));
+        if (c) c->in = malloc(CONN_IN_SIZE);
+        if (!c || !c->in) {
+            printf("Out of memory, dropping connection\n");
+            free(c);
+            close(fd);
+            continue;
+        }
+        c->in_size = CONN_IN_SIZE;
+        c->proto = 1;
+        c->fd = fd;
+        c->cwd_fd = -1;
+        c->events = EPOLLIN;
+        c->uid = cred.uid;
+        c->gid = cred.gid;
+        c->trusted = c->authed = (policy == POLICY_TRUST);
+
+        ev.events = EPOLLIN;
+        ev.data.ptr = c;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            perror("epoll_ctl(ADD) failed");
+            close(fd);
+            free(c->in);
+            free(c);
+            continue;
+        }
+
+        printf("[%d] Connection opened\n", fd);
+        num_conns++;
+        num_served++;
+        update_slot();
+
+        // Time to recycle? Finish what we have, but take no more
+        if (max_requests && num_served >= max_requests) {
+            epoll_ctl(epfd, EPOLL_CTL_DEL, sck, NULL);
+            draining = 1;
+        }
+    }
+}
+
+// Reaps every child which has ended, and tells the clients of
+// direct launches
+static void reap_children(int sfd) {
+    struct signalfd_siginfo info;
+    struct conn *c;
+    int status;
+    pid_t pid;
+
+    while (read(sfd, &info, sizeof(info)) == sizeof(info));
+
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        zygote_reaped(pid);
+
+        for (c = waiting; c && c->child != pid; c = c->next_waiting);
+        if (!c) continue;
+
+        conn_unwait(c);
+        conn_exit(c, status);
+        conn_settle(c);
+    }
+}
+
+// Takes SIGCHLD through a descriptor, so that children can be
+// reaped from the event loop. Call before starting any threads.
+// Returns the descriptor, or -1 on failure.
+static int init_child_watch(void) {
+    struct sigaction act;
+    sigset_t mask;
+    int sfd;
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+
+    sfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (sfd < 0) {
+        perror("signalfd() failed");
+        return -1;
+    }
+
+    // Exit statuses are wanted now, so no more auto-reaping
+    memset(&act, '\0', sizeof(act));
+    act.sa_handler = SIG_DFL;
+    sigaction(SIGCHLD, &act, NULL);
+
+    return sfd;
+}
+
+// Runs the event loop on the listening socket. Only returns on
+// failure, or once a recycled worker has served its last client.
+static int serve(int sck) {
+    struct epoll_event ev, events[MAX_EVENTS];
+    int hashfd, childfd, timeout;
+
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd < 0) {
+        perror("epoll_create1() failed");
+        return -1;
+    }
+
+    // Before the hashing threads, so that they have SIGCHLD blocked too
+    childfd = init_child_watch();
+    if (childfd < 0) return -1;
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = &child_tag;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, childfd, &ev) < 0) {
+        perror("epoll_ctl(ADD) failed");
+        return -1;
+    }
+
+    // Threads don't survive a fork, so every worker starts its own
+    if (auth_threads <= 0) auth_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (auth_threads <= 0) auth_threads = 1;
+    hashfd = hashpool_init(auth_threads, AUTH_MAX_PENDING);
+    if (hashfd < 0) return -1;
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = &hashpool_tag;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, hashfd, &ev) < 0) {
+        perror("epoll_ctl(ADD) failed");
+        return -1;
+    }
+
+    // Without the watch, the passwd file is read on every auth
+    config_watch = init_config_watch();
+    if (config_watch >= 0) {
+        ev.events = EPOLLIN;
+        ev.data.ptr = &config_tag;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, config_watch, &ev) < 0) {
+            perror("epoll_ctl(ADD) failed");
+            close(config_watch);
+            config_watch = -1;
+        }
+    }
+
+    ev.events = EPOLLIN;
+#ifdef EPOLLEXCLUSIVE
+    // Only wake one worker per incoming connection
+    if (pool_slot) ev.events |= EPOLLEXCLUSIVE;
+#endif
+    ev.data.ptr = &listen_tag;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, sck, &ev) < 0) {
+        perror("epoll_ctl(ADD) failed");
+        return -1;
+    }
+
+    // Each worker has PTYs of its own
+    if (ptypool_init(pty_pool_size) < 0) {
+        printf("Out of memory\n");
+        return -1;
+    }
+    timeout = zygote_fill();
+    ptypool_fill();
+
+    while (!draining || num_conns) {
+        int i, n;
+
+        // Not at all while warm sessions are left to start, and no
+        // longer than until one is due to be retried
+        n = epoll_wait(epfd, events, MAX_EVENTS, timeout);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait() failed in main loop");
+            return -1;
+        }
+
+        for (i = 0; i < n; i++) {
+            if (events[i].data.ptr == &listen_tag) {
+                // Incoming connection
+                accept_conns(sck);
+            } else if (events[i].data.ptr == &hashpool_tag) {
+                // Passwords checked
+                hashpool_complete(&auth_done);
+            } else if (events[i].data.ptr == &config_tag) {
+                // Password changed
+                config_changed();
+            } else if (events[i].data.ptr == &child_tag) {
+                // Somebody's command ended
+                reap_children(childfd);
+            } else {
+                conn_event(events[i].data.ptr, events[i].events);
+            }
+        }
+
+        // Replace the warm sessions and PTYs which were handed out
+        timeout = zygote_fill();
+        ptypool_fill();
+    }
+
+    return 0;
+}
+
+// Forks a worker into the given slot
+// Returns the PID of the worker, or -1 on failure
+static pid_t spawn_worker(int sck, struct worker_slot *slot) {
+    pid_t pid;
+
+    // Don't let the worker inherit our pending output
+    fflush(stdout);
+
+    pid = fork();
+    if (pid < 0) {
+        perror("Failed to fork worker");
+        return -1;
+    }
+
+    if (pid > 0) {
+        // In parent
+        slot->pid = pid;
+        slot->started = now_ms();
+        slot->conns = 0;
+        slot->served = 0;
+        return pid;
+    }
+
+    // In worker
+    pool_slot = slot;
+    init_signals();
+    exit(serve(sck) ? EXIT_FAILURE : EXIT_SUCCESS);
+}
+
+// Holds off refilling the slot, for longer each time
+static void delay_respawn(struct worker_slot *slot, int64_t now) {
+    if (!slot->delay) slot->delay = RESPAWN_MIN_DELAY;
+    else if (slot->delay < RESPAWN_MAX_DELAY) slot->delay *= 2;
+    slot->respawn_at = now + slot->delay;
+}
+
+// Forks a worker for every empty slot whose time has come
+// Returns the milliseconds until the next one is due, or -1 if
+// every slot has a worker
+static int64_t fill_slots(int sck, struct worker_slot *slots, int n) {
+    int64_t now = now_ms(), next = -1;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        if (slots[i].pid) continue;
+        if (slots[i].respawn_at <= now) {
+            if (spawn_worker(sck, &slots[i]) > 0) continue;
+            delay_respawn(&slots[i], now);
+        }
+        if (next < 0 || slots[i].respawn_at - now < next) {
+            next = slots[i].respawn_at - now;
+        }
+    }
+    return next;
+}
+
+static volatile int report_requested = 0;
+
+static void handle_sigusr1(int sig) {
+    report_requested = 1;
+}
+
+// Prints how busy the worker pool is
+static void report_pool(struct worker_slot *slots, int n) {
+    int i, busy = 0, conns = 0;
+
+    for (i = 0; i < n; i++) {
+        if (slots[i].pid <= 0) continue;
+        if (slots[i].conns) busy++;
+        conns += slots[i].conns;
+    }
+
+    printf("Pool: %d/%d workers busy, %d connections\n", busy, n, conns);
+    for (i = 0; i < n; i++) {
+        printf("  worker %d: pid %d, %d active, %lu served\n", i,
+                (int) slots[i].pid, slots[i].conns, slots[i].served);
+    }
+    fflush(stdout);
+}
+
+// Pre-forks the workers, then keeps the pool at full strength.
+// Send SIGUSR1 to get a report of the pool occupancy.
+static int run_pool(int sck, int nworkers) {
+    struct worker_slot *slots;
+    struct sigaction act;
+    struct timespec ts;
+    int64_t now, wait;
+    sigset_t chld;
+    pid_t pid;
+    int i, status, started;
+
+    // Shared with the workers, so they can report their load
+    slots = mmap(NULL, nworkers * sizeof(*slots), PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (slots == MAP_FAILED) {
+        perror("Failed to allocate worker slots");
+        return -1;
+    }
+    memset(slots, '\0', nworkers * sizeof(*slots));
+
+    // The supervisor reaps its workers itself
+    memset(&act, '\0', sizeof(act));
+    act.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &act, NULL);
+    act.sa_handler = SIG_DFL;
+    sigaction(SIGCHLD, &act, NULL);
+
+    // Waited for with sigtimedwait(). The workers block it too.
+    sigemptyset(&chld);
+    sigaddset(&chld, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &chld, NULL);
+
+    // No SA_RESTART, so the wait is interrupted for the report
+    act.sa_handler = &handle_sigusr1;
+    sigaction(SIGUSR1, &act, NULL);
+
+    fill_slots(sck, slots, nworkers);
+    for (i = started = 0; i < nworkers; i++) {
+        if (slots[i].pid) started++;
+    }
+    printf("Started %d workers\n", started);
+
+    while (1) {
+        if (report_requested) {
+            report_requested = 0;
+            report_pool(slots, nworkers);
+        }
+
+        pid = waitpid(-1, &status, WNOHANG);
+        if (pid < 0 && errno != ECHILD) {
+            if (errno == EINTR) continue;
+            perror("waitpid() failed in supervisor");
+            return -1;
+        }
+
+        if (pid <= 0) {
+            // Sleep until a worker exits, an empty slot is due to be
+            // filled, or a report is asked for
+            wait = fill_slots(sck, slots, nworkers);
+            if (wait < 0) {
+                sigwaitinfo(&chld, NULL);
+            } else {
+                ts.tv_sec = wait / 1000;
+                ts.tv_nsec = (wait % 1000) * 1000000;
+                sigtimedwait(&chld, NULL, &ts);
+            }
+            continue;
+        }
+
+        for (i = 0; i < nworkers; i++) {
+            if (slots[i].pid == pid) break;
+        }
+        if (i == nworkers) continue;
+        slots[i].pid = 0;
+
+        now = now_ms();
+        if (WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS) {
+            printf("Worker %d (pid %d) recycled\n", i, (int) pid);
+            slots[i].delay = 0;
+            slots[i].respawn_at = 0;
+        } else if (now - slots[i].started < RESPAWN_MIN_LIFE) {
+            // Don't spin if workers keep dying right away
+            delay_respawn(&slots[i], now);
+            printf("Worker %d (pid %d) died, respawning in %d ms\n", i,
+                    (int) pid, (int) slots[i].delay);
+        } else {
+            printf("Worker %d (pid %d) died, respawning\n", i, (int) pid);
+            slots[i].delay = 0;
+            slots[i].respawn_at = 0;
+        }
+
+        fill_slots(sck, slots, nworkers);
+        report_pool(slots, nworkers);
+    }
+
+    return 0;
+}
+
+static void usage(void) {
+    printf(
+        "Usage: pts-daemon [-D] [-a <threads>] [-t <seconds>] [-l <bytes>]\n"
+        "                  [-p <count>] [-z <count>:<command>]...\n"
+        "                  [-w <workers> [-r <requests>]]\n"
+        "  -D  Run in the background\n"
+        "  -a  Number of password hashing threads (default: one per CPU)\n"
+        "  -t  Lifetime of session tickets, 0 to disable (default: %d)\n"
+        "  -l  Longest text request accepted (default: %d)\n"
+        "  -p  Number of PTYs kept open ahead of time (default: %d)\n"
+        "  -z  Keep this many sessions of the command started ahead of time\n"
+        "  -w  Pre-fork this many worker processes\n"
+        "  -r  Recycle a worker after it has served this many connections\n",
+        TICKET_LIFETIME, PROTO_MAX_MSG, PTY_POOL_SIZE
+    );
+}
+
+// Daemon entry point
+int pts_daemon_main(int argc, char *argv[]) {
+    int sck, opt, nworkers = 0, background = 0;
+    int ticket_lifetime = TICKET_LIFETIME;
+
+    while ((opt = getopt(argc, argv, "Da:t:l:p:z:w:r:")) != -1) {
+        switch (opt) {
+            case 'D': background = 1; break;
+            case 'a': auth_threads = atoi(optarg); break;
+            case 't': ticket_lifetime = atoi(optarg); break;
+            case 'l': max_line = strtoul(optarg, NULL, 10); break;
+            case 'p': pty_pool_size = atoi(optarg); break;
+            case 'z':
+                if (zygote_config(optarg) < 0) {
+                    usage();
+                    return 1;
+                }
+                break;
+            case 'w': nworkers = atoi(optarg); break;
+            case 'r': max_requests = strtoul(optarg, NULL, 10); break;
+            default:
+                usage();
+                return 1;
+        }
+    }
+
+    if (nworkers < 0) {
+        usage();
+        return 1;
+    }
+
+    if (background) {
+        daemonize();
+    }
+
+    if (check_path(PATH_PREFIX)) return -1;
+
+    // Initialization
+    printf("Initializing daemon\n");
+
+    sck = init_socket("/dev/pts-daemon");
+    if (sck < 0) {
+        return -1;
+    }
+
+    // Before forking, so that every worker honours every ticket
+    ticket_init(ticket_lifetime);
+
+    printf("Entering main loop\n");
+    listen(sck, LISTEN_BACKLOG);
+
+    if (nworkers > 0) {
+        return run_pool(sck, nworkers);
+    }
+
+    if (init_signals()) return -1;
+
+    // Without workers there's nobody to take over
+    max_requests = 0;
+    return serve(sck);
+}
@@ -14,7 +14,7 @@
  * limitations under the License.
  */
 
-#define _XOPEN_SOURCE
+#define _GNU_SOURCE
 
 #include <stdlib.h>
 #include <stdio.h>
@@ -22,8 +22,30 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <paths.h>
+#include <errno.h>
+#include <sched.h>
+#include <signal.h>
 #include <termios.h>
 #include <sys/ioctl.h>
+#include <sys/syscall.h>
+
+// Stack for the child of pts_spawn(), which only has to last until execve()
+#define SPAWN_STACK     (16 * 1024)
+
+// Shared between spawn() and its child, which runs in the same memory
+struct spawn_args {
+    int stdio[3];
+    int ctty;               // stdio[0] is a PTS to become the terminal of
+    char **cmd_argv;
+    char **envp;
+    int cwd_fd;
+    const struct termios *tio;
+    const struct winsize *ws;
+    sigset_t mask;          // The caller's signal mask
+
+    const char *failed;     // Set by the child if it couldn't exec
+    int err;
+};
 
 static void usage() {
     printf(
@@ -31,35 +53,162 @@ static void usage() {
     );
 }
 
-int pts_exec(char *dev_name, char **cmd_argv) {
-    int pts_fd;
+// Our environment, with the NAME=value strings in env added or
+// replacing what's there. Only the pointer array is allocated.
+// Returns NULL if out of memory.
+static char **merge_env(char **env) {
+    size_t n, i, len;
+    char **envp;
+
+    for (n = 0; environ[n]; n++);
+    for (i = 0; env && env[i]; i++);
+
+    envp = calloc(n + i + 1, sizeof(*envp));
+    if (!envp) return NULL;
+    memcpy(envp, environ, n * sizeof(*envp));
 
-    // Disassociate from terminal
-    if (setsid() == (pid_t) -1) {
-        perror("WARNING, setsid() failed");
+    for (; env && *env; env++) {
+        len = strcspn(*env, "=") + 1;
+        for (i = 0; i < n; i++) {
+            if (strncmp(envp[i], *env, len) == 0) break;
+        }
+        envp[i] = *env;
+        if (i == n) n++;
     }
 
-    // Open the PTS device
-    pts_fd = open(dev_name, O_RDWR);
-    if (pts_fd == -1) {
-        perror("Failed to open PTS device");
-        return EXIT_FAILURE;
+    return envp;
+}
+
+// The child of spawn(). It borrows the parent's memory, so it must
+// not touch anything but its own stack and the arguments: no stdio,
+// no malloc, no environ.
+static int spawn_child(void *arg) {
+    struct spawn_args *a = arg;
+    struct sigaction act;
+    sigset_t none;
+    int sig, i;
+
+    // None of the caller's handlers may run in here, and nothing
+    // it blocked stays blocked for the command
+    memset(&act, '\0', sizeof(act));
+    act.sa_handler = SIG_DFL;
+    for (sig = 1; sig < NSIG; sig++) sigaction(sig, &act, NULL);
+    sigemptyset(&none);
+    sigprocmask(SIG_SETMASK, &none, NULL);
+
+    // Disassociate from terminal. This can only fail if we
+    // already lead a session, and then there's no harm.
+    setsid();
+
+    if (a->cwd_fd >= 0 && fchdir(a->cwd_fd) < 0) {
+        a->failed = "Failed to change directory";
+        a->err = errno;
+        _exit(127);
+    }
+
+    // The PTS becomes our controlling terminal. Everything here is
+    // best effort.
+    if (a->ctty) {
+        ioctl(a->stdio[0], TIOCSCTTY, 0);
+        if (a->tio) tcsetattr(a->stdio[0], TCSANOW, a->tio);
+        if (a->ws) ioctl(a->stdio[0], TIOCSWINSZ, a->ws);
     }
 
     // Replace std{in,out,err}
-    dup2(pts_fd, 0);
-    dup2(pts_fd, 1);
-    dup2(pts_fd, 2);
-
-    // Launch the target command
-    execv(cmd_argv[0], cmd_argv);
-    perror("Failed to execv()");
-    return EXIT_FAILURE;
+    for (i = 0; i < 3; i++) dup2(a->stdio[i], i);
+
+    // Nothing else the caller had open goes to the command. Kernels
+    // without close_range() get by on the caller's O_CLOEXEC.
+#ifdef __NR_close_range
+    syscall(__NR_close_range, 3, ~0U, 0);
+#endif
+
+    execve(a->cmd_argv[0], a->cmd_argv, a->envp);
+    a->failed = "Failed to execv()";
+    a->err = errno;
+    _exit(127);
+}
+
+// Runs a's command in a new session. The child shares our memory
+// until it calls execve(), so nothing is copied however large the
+// caller is. The NAME=value strings in env (if not NULL) are added to
+// our environment.
+// Returns the PID of the child, or -1 on failure. If failed is not
+// NULL, it is then set to what went wrong, with errno.
+static pid_t spawn(struct spawn_args *a, char **env, const char **failed) {
+    char stack[SPAWN_STACK] __attribute__((aligned(16)));
+    sigset_t all;
+    pid_t pid;
+
+    a->envp = merge_env(env);
+    if (!a->envp) {
+        if (failed) *failed = "Failed to set up the environment";
+        errno = ENOMEM;
+        return -1;
+    }
+
+    // Keep signals off the child until it has reset the handlers
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &a->mask);
+
+    // We're suspended until the child execs or exits
+    pid = clone(&spawn_child, stack + sizeof(stack),
+            CLONE_VM | CLONE_VFORK | SIGCHLD, a);
+    if (pid == -1) {
+        a->failed = "Failed to clone()";
+        a->err = errno;
+    } else if (a->failed) {
+        // It has exited already
+        pid = -1;
+    }
+
+    pthread_sigmask(SIG_SETMASK, &a->mask, NULL);
+    free(a->envp);
+
+    if (pid == -1) {
+        if (failed) *failed = a->failed;
+        errno = a->err;
+    }
+    return pid;
+}
+
+// Starts cmd_argv with the PTS pts_fd (which the caller keeps) as
+// its controlling terminal. cwd_fd (if not -1) is the directory to
+// run in, env is as for spawn(), and tio and ws may be NULL.
+// Returns the PID of the child, or -1 on failure, like spawn().
+pid_t pts_spawn(int pts_fd, char **cmd_argv, char **env, int cwd_fd,
+        const struct termios *tio, const struct winsize *ws,
+        const char **failed) {
+    struct spawn_args a;
+
+    memset(&a, '\0', sizeof(a));
+    a.stdio[0] = a.stdio[1] = a.stdio[2] = pts_fd;
+    a.ctty = 1;
+    a.cmd_argv = cmd_argv;
+    a.cwd_fd = cwd_fd;
+    a.tio = tio;
+    a.ws = ws;
+    return spawn(&a, env, failed);
+}
+
+// Starts cmd_argv on the given stdin, stdout and stderr, without a
+// terminal. They must all be above 2, and the caller keeps them.
+// Otherwise like pts_spawn().
+pid_t fd_spawn(const int *stdio, char **cmd_argv, char **env, int cwd_fd,
+        const char **failed) {
+    struct spawn_args a;
+
+    memset(&a, '\0', sizeof(a));
+    memcpy(a.stdio, stdio, sizeof(a.stdio));
+    a.cmd_argv = cmd_argv;
+    a.cwd_fd = cwd_fd;
+    return spawn(&a, env, failed);
 }
 
 int pts_exec_main(int argc, char *argv[]) {
-    char *dev_name;
+    const char *failed = NULL;
     char **cmd_argv;
+    int pts_fd;
     pid_t pid;
 
     if (argc < 3) {
@@ -67,21 +216,22 @@ int pts_exec_main(int argc, char *argv[]) {
         return 1;
     }
 
-    dev_name = argv[1];
     cmd_argv = &argv[2];
-    
-    // Fork
-    pid = fork();
-    if (pid == -1) {
-        perror("Failed to fork");
-        return -1;
+
+    // Open the PTS device
+    pts_fd = open(argv[1], O_RDWR | O_NOCTTY | O_CLOEXEC);
+    if (pts_fd == -1) {
+        perror("Failed to open PTS device");
+        return EXIT_FAILURE;
     }
-    if (pid > 0) {
-        // In parent
-        printf("PID of child = %d\n", pid);
-        return 0;
+
+    pid = pts_spawn(pts_fd, cmd_argv, NULL, -1, NULL, NULL, &failed);
+    close(pts_fd);
+    if (pid == -1) {
+        perror(failed ? failed : "Failed to launch");
+        return EXIT_FAILURE;
     }
-    
-    // In child
-    return pts_exec(dev_name, cmd_argv);
+
+    printf("PID of child = %d\n", pid);
+    return 0;
 }
@@ -20,6 +20,8 @@
 #include <unistd.h>
 #include <signal.h>
 #include <fcntl.h>
+#include <sys/stat.h>
+#include <linux/limits.h>
 
 #include "helpers.h"
 #include "bcrypt.h"
@@ -56,24 +58,38 @@ char *get_new_passwd(void) {
     return pwd1;
 }
 
-// Save the new password
-int set_passwd(FILE *passwd, char *newpwd) {
-    char *hash;
+// Save the new password. The hash goes to a temporary file which
+// then replaces the passwd file, so the daemon never sees half of it.
+int set_passwd(const char *path, char *newpwd) {
+    char tmp_path[PATH_MAX], *hash;
     size_t len;
+    int fd;
 
     // Calculate the hash
     hash = bcrypt(newpwd, bcrypt_gensalt(11));
 
-    // Rewind the stream
-    if (fseek(passwd, 0, SEEK_SET) < 0) {
-        perror("Unable to rewind passwd file");
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW,
+            S_IRUSR | S_IWUSR);
+    if (fd < 0) {
+        perror("Unable to create new passwd file");
         return -1;
     }
 
     // Write 'em
     len = strlen(hash) + 1; // Include NUL
-    if (fwrite(hash, 1, len, passwd) != len) {
-        printf("Warning: An error might have occured writing the password\n");
+    if (write_to_fd(fd, (unsigned char *) hash, len) < 0 || fsync(fd) < 0) {
+        perror("Unable to write new passwd file");
+        close(fd);
+        unlink(tmp_path);
+        return -1;
+    }
+    close(fd);
+
+    if (rename(tmp_path, path) < 0) {
+        perror("Unable to replace passwd file");
+        unlink(tmp_path);
+        return -1;
     }
 
     return 0;
@@ -116,7 +132,7 @@ int pts_passwd_main(int argc, char *argv[]) {
         goto cleanup;
     }
 
-    ret = set_passwd(passwd, newpwd);
+    ret = set_passwd(PATH_PREFIX "/passwd", newpwd);
     if (ret) {
         printf("Password unchanged\n");
     } else {
@@ -19,13 +19,20 @@
 #include <string.h>
 #include <unistd.h>
 #include <signal.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <sys/stat.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <sys/ioctl.h>
+#include <termios.h>
 #include <linux/limits.h>
 
 #include "helpers.h"
 #include "bcrypt.h"
+#include "proto.h"
+#include "relay.h"
 
 int pts_wrap(int pts_fd);
 
@@ -89,131 +96,567 @@ static int parse_server_response(FILE *fp, char **msg) {
     return ret;
 }
 
-// Authenticate with the daemon
-static void authenticate(FILE *fp, char *pwd) {
-    char *tmp;
-    int ret;
+// Where the daemon's session ticket for this user is kept
+static void ticket_path(char *buf, size_t size) {
+    const char *dir = getenv("HOME");
 
-    // Authenticate with the daemon
-    if (fprintf(fp, "auth %s\n", pwd) < 0) {
-        fprintf(stderr, "Unable to communicate with daemon\n");
-        exit(-1);
+    if (!dir || !*dir) dir = getenv("TMPDIR");
+    if (!dir || !*dir) dir = "/data/local/tmp";
+    snprintf(buf, size, "%s/.pts-ticket-%d", dir, (int) getuid());
+}
+
+// Checks that fd is a regular file which only we can get at
+static int ticket_file_ok(int fd) {
+    struct stat st;
+
+    if (fstat(fd, &st) < 0) return 0;
+    return S_ISREG(st.st_mode) && st.st_uid == getuid() &&
+        !(st.st_mode & (S_IRWXG | S_IRWXO));
+}
+
+// Reads the cached ticket
+// Returns -1 if there is none
+static int load_ticket(char *buf, size_t size) {
+    char path[PATH_MAX];
+    ssize_t len;
+    int fd;
+
+    ticket_path(path, sizeof(path));
+    fd = open(path, O_RDONLY | O_NOFOLLOW);
+    if (fd < 0) return -1;
+
+    if (!ticket_file_ok(fd)) {
+        close(fd);
+        return -1;
     }
 
-    ret = parse_server_response(fp, &tmp);
-    if (ret == -1) {
-        fprintf(stderr, "Server returned unexpected response\n");
-        exit(-1);
-    } else if (ret == 0) {
-        fprintf(stderr, "Authentication failed: %s\n", tmp);
+    len = read(fd, buf, size - 1);
+    close(fd);
+    if (len <= 0) return -1;
+
+    buf[len] = '\0';
+    terminate_buf(buf, size);
+    return 0;
+}
+
+// Caches a ticket for the next pts-shell. Failure is not an
+// error, we just ask for the password next time.
+static void save_ticket(const char *ticket) {
+    char path[PATH_MAX];
+    int fd;
+
+    ticket_path(path, sizeof(path));
+    fd = open(path, O_WRONLY | O_CREAT | O_NOFOLLOW, S_IRUSR | S_IWUSR);
+    if (fd < 0) return;
+
+    // Don't write into somebody else's file
+    if (fchmod(fd, S_IRUSR | S_IWUSR) < 0 || !ticket_file_ok(fd) ||
+            ftruncate(fd, 0) < 0) {
+        close(fd);
+        return;
+    }
+
+    write_to_fd(fd, (unsigned char *) ticket, strlen(ticket));
+    close(fd);
+}
+
+static void forget_ticket(void) {
+    char path[PATH_MAX];
+
+    ticket_path(path, sizeof(path));
+    unlink(path);
+}
+
+// The daemon's answer to a request
+struct reply {
+    int status;             // 1 (success), 0 (failure) or -1
+    int stage;              // What a failed launch got up to
+    char *msg;
+    char *ticket;           // Or NULL
+    char *warning;          // Or NULL
+    int ptm;                // The daemon passed us a PTY master
+    int pipes;              // Or the command's stdin, stdout and stderr
+};
+
+// Descriptors the daemon passed along with its replies
+static int passed_fds[3], num_passed = 0;
+
+static void comm_failed(void) {
+    fprintf(stderr, "Unable to communicate with daemon\n");
+    exit(-1);
+}
+
+static int connect_daemon(void) {
+    int sck;
+
+    sck = unix_socket_connect("/dev/pts-daemon");
+    if (sck == -1) exit(-1);
+    return sck;
+}
+
+// The text protocol is read with stdio
+static FILE *connect_daemon_v1(void) {
+    FILE *fp;
+
+    fp = fdopen(connect_daemon(), "w+");
+    if (!fp) {
+        perror("fdopen");
         exit(-1);
     }
 
+    return fp;
 }
 
-static void request_exec(FILE *fp, char *pts_name, char *argv[]) {
-    int i, ret;
+// v2 replies may come with descriptors, which stdio would drop,
+// so they're read straight off the socket
+// Returns -1 on EOF or error
+static int sock_read(int sck, void *buf, size_t len) {
+    ssize_t ret;
+
+    while (len) {
+        ret = recv_fds(sck, buf, len, passed_fds, &num_passed, 3);
+        if (ret <= 0) return -1;
+        buf = (char *) buf + ret;
+        len -= ret;
+    }
+    return 0;
+}
+
+// Returns -1 on error, with errno set
+static int sock_write(int sck, const void *buf, size_t len) {
+    ssize_t ret;
+
+    while (len) {
+        ret = send(sck, buf, len, MSG_NOSIGNAL);
+        if (ret < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        buf = (const char *) buf + ret;
+        len -= ret;
+    }
+    return 0;
+}
+
+// The same, passing n descriptors with the first of it
+static int sock_write_fds(int sck, const void *buf, size_t len,
+        const int *fds, int n) {
+    ssize_t ret = 0;
+
+    if (n) {
+        ret = send_fds(sck, buf, len, fds, n);
+        if (ret < 0) return -1;
+    }
+    return sock_write(sck, (const char *) buf + ret, len - ret);
+}
+
+// Reads the daemon's answer to the hello, a text line
+// Returns 1 (success), 0 (failure) or -1 like parse_server_response()
+static int read_hello_reply(int sck, char **msg) {
+    static char buf[256];
+    size_t len = 0;
+
+    while (len < sizeof(buf) - 1) {
+        if (sock_read(sck, buf + len, 1) < 0) return -1;
+        if (buf[len++] == '\n') break;
+    }
+    buf[len] = '\0';
+    terminate_buf(buf, sizeof(buf));
+
+    if (len < 2 || (buf[0] != '0' && buf[0] != '1') || buf[1] != ' ') {
+        return -1;
+    }
+    *msg = buf + 2;
+    return buf[0] == '1';
+}
+
+static char *ask_password(char *buf, size_t size) {
+    // Not on stdout, which may be going somewhere with --direct
+    passwd_init_terminal();
+    fprintf(stderr, "(pts-shell) Enter your password: ");
+    if (fgets(buf, size, stdin) == NULL) exit(-1);
+    passwd_deinit_terminal();
+    terminate_buf(buf, size);
+    return buf;
+}
+
+// Reads a v2 reply into r. The reply stays valid until the next
+// call. Returns r->status.
+static int v2_read_reply(int sck, struct reply *r) {
+    static char *body = NULL;
+    struct proto_field f;
+    struct proto_hdr hdr;
+    uint32_t off = 0;
     char *tmp;
 
-    if (fprintf(fp, "exec %s ", pts_name) < 0) {
-        fprintf(stderr, "Unable to communicate with daemon\n");
-        exit(-1);
+    memset(r, '\0', sizeof(*r));
+    r->status = -1;
+    r->msg = "";
+
+    if (sock_read(sck, &hdr, sizeof(hdr)) < 0) return -1;
+    if (hdr.type != PROTO_REPLY || hdr.len > PROTO_MAX_MSG) return -1;
+
+    // One extra byte, so an empty body is never a NULL buffer
+    tmp = realloc(body, hdr.len + 1);
+    if (!tmp) return -1;
+    body = tmp;
+    if (hdr.len && sock_read(sck, body, hdr.len) < 0) return -1;
+
+    while (proto_next(body, hdr.len, &off, &f) > 0) {
+        switch (f.tag) {
+            case PROTO_T_STATUS: r->status = proto_u32(&f, -1); break;
+            case PROTO_T_STAGE: r->stage = proto_u32(&f, 0); break;
+            case PROTO_T_MSG: r->msg = (char *) proto_str(&f); break;
+            case PROTO_T_TICKET: r->ticket = (char *) proto_str(&f); break;
+            case PROTO_T_WARNING: r->warning = (char *) proto_str(&f); break;
+            case PROTO_T_PTM: r->ptm = 1; break;
+            case PROTO_T_PIPES: r->pipes = 1; break;
+        }
+    }
+    if (!r->msg) r->msg = "";
+    if (r->status != 0 && r->status != 1) r->status = -1;
+
+    return r->status;
+}
+
+// A LAUNCH message: the credentials we have, the command, and the
+// directory, TERM and terminal settings for the PTS, which the
+// daemon opens and passes back. flags are the PROTO_F_* to ask
+// for. Only a PTY launch has the terminal business, and a direct
+// one passes its directory along with stdio.
+// Returns -1 if it got too large
+static int build_launch(struct proto_buf *req, const char *ticket,
+        const char *pwd, char *argv[], uint32_t flags) {
+    struct termios tio;
+    struct winsize ws;
+    char *cwd, *term, env[128];
+    int i, ret = 0;
+
+    ret |= proto_begin(req, PROTO_LAUNCH);
+    if (ticket) ret |= proto_add_str(req, PROTO_T_TICKET, ticket);
+    if (pwd) ret |= proto_add_str(req, PROTO_T_PASSWORD, pwd);
+
+    for (i = 0; argv[i]; i++) {
+        ret |= proto_add_str(req, PROTO_T_ARG, argv[i]);
     }
 
-    i = 0;
-    while(1) {
-        if (argv[i + 1]) {
-            fprintf(fp, "%s ", argv[i]);
+    if (!(flags & PROTO_F_DIRECT)) {
+        cwd = malloc(PATH_MAX);
+        if (cwd && getcwd(cwd, PATH_MAX)) {
+            ret |= proto_add_str(req, PROTO_T_CWD, cwd);
         } else {
-            fprintf(fp, "%s\n", argv[i]);
-            break;
+            fprintf(stderr, "Warning: Could not get current working directory\n");
         }
+        free(cwd);
+    }
+
+    // The new PTS is driven by our terminal
+    if (flags & PROTO_F_TAKE_PTY) {
+        term = getenv("TERM");
+        if (term) {
+            snprintf(env, sizeof(env), "TERM=%s", term);
+            ret |= proto_add_str(req, PROTO_T_ENV, env);
+        }
+        if (tcgetattr(STDIN_FILENO, &tio) == 0) {
+            ret |= proto_add(req, PROTO_T_TERMIOS, &tio, sizeof(tio));
+        }
+        if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0) {
+            ret |= proto_add(req, PROTO_T_WINSIZE, &ws, sizeof(ws));
+        }
+    }
+    ret |= proto_add_u32(req, PROTO_T_FLAGS, flags);
+
+    proto_end(req);
+    return ret ? -1 : 0;
+}
+
+// Authenticates and launches in one round trip. With hello, the
+// switch to v2 goes out in the same write. A direct launch passes
+// fds (stdin, stdout, stderr and the directory), else fds is NULL.
+// Returns the reply status, or -2 if the daemon doesn't know v2
+static int launch_v2(int sck, int hello, const char *ticket,
+        const char *pwd, char *argv[], uint32_t flags, const int *fds,
+        struct reply *r) {
+    int write_failed = 0, nfds = fds ? 4 : 0;
+    struct proto_buf req;
+    char *msg = "";
+
+    memset(&req, '\0', sizeof(req));
+    if (build_launch(&req, ticket, pwd, argv, flags) < 0) {
+        fprintf(stderr, "Command too long\n");
+        exit(-1);
     }
 
-    ret = parse_server_response(fp, &tmp);
+    // A daemon which turns us away may hang up before this is
+    // written, so look for its answer before giving up. The
+    // descriptors go with the first write, and are kept by the
+    // daemon for the LAUNCH.
+    if (hello) {
+        if (sock_write_fds(sck, PROTO_V2_HELLO "\n", 3, fds, nfds) < 0) {
+            write_failed = 1;
+        }
+        nfds = 0;
+    }
+    if (!write_failed && sock_write_fds(sck, req.data, req.len, fds, nfds) < 0) {
+        write_failed = 1;
+    }
+    proto_free(&req);
+    if (write_failed && !hello) comm_failed();
+
+    if (hello && read_hello_reply(sck, &msg) != 1) {
+        // Turned away by the daemon's policy
+        if (strncmp(msg, "Access denied", 13) == 0) {
+            fprintf(stderr, "Access denied by the daemon\n");
+            exit(-1);
+        }
+
+        // Older daemons answer the hello with a "0" and ignore the
+        // rest, as they haven't seen an auth
+        return -2;
+    }
+    if (write_failed) comm_failed();
+
+    return v2_read_reply(sck, r);
+}
+
+// Waits for the end of a direct or pipe launch
+// Returns its exit status, or 128 + the signal that killed it
+static int v2_read_exit(int sck) {
+    static char body[64];
+    struct proto_field f;
+    struct proto_hdr hdr;
+    uint32_t off = 0;
+    int ret = -1;
+
+    if (sock_read(sck, &hdr, sizeof(hdr)) < 0 || hdr.type != PROTO_EXIT ||
+            hdr.len > sizeof(body) || sock_read(sck, body, hdr.len) < 0) {
+        comm_failed();
+    }
+
+    while (proto_next(body, hdr.len, &off, &f) > 0) {
+        if (f.tag == PROTO_T_EXIT) ret = proto_u32(&f, -1);
+        else if (f.tag == PROTO_T_SIGNAL) ret = 128 + proto_u32(&f, 0);
+    }
+    return ret;
+}
+
+// Relays our stdin to a pipe launch, and its stdout and stderr
+// back to ours, until it has ended and its output has run dry.
+// pipes are the command's stdin, stdout and stderr.
+// Returns its exit status, or 128 + the signal that killed it
+static int relay_pipes(int sck, const int *pipes) {
+    // Relay i polls with pfd[2 * i] and pfd[2 * i + 1]
+    struct relay rl[3];
+    struct pollfd pfd[7];
+    int i, done[3] = { 0, 0, 0 }, exited = 0, status = -1;
+
+    relay_init(&rl[0], STDIN_FILENO, pipes[0]);
+    relay_init(&rl[1], pipes[1], STDOUT_FILENO);
+    relay_init(&rl[2], pipes[2], STDERR_FILENO);
+
+    while (!(done[1] && done[2] && exited)) {
+        for (i = 0; i < 3; i++) {
+            if (!done[i]) relay_poll(&rl[i], &pfd[2 * i]);
+            else pfd[2 * i].fd = pfd[2 * i + 1].fd = -1;
+        }
+        pfd[6].fd = exited ? -1 : sck;
+        pfd[6].events = POLLIN;
+
+        if (poll(pfd, 7, -1) < 0) {
+            if (errno == EINTR) continue;
+            perror("poll() failed");
+            exit(-1);
+        }
+
+        for (i = 0; i < 3; i++) {
+            if (done[i] || relay_events(&rl[i], &pfd[2 * i]) == 0) continue;
+
+            // At the end of it, or the other side's gone. Either
+            // way the pipe is closed, so the command sees it.
+            if (i == 0) relay_free(&rl[0]);
+            close(pipes[i]);
+            done[i] = 1;
+        }
+
+        if (pfd[6].fd >= 0 && pfd[6].revents) {
+            status = v2_read_exit(sck);
+            exited = 1;
+        }
+    }
+
+    // Together, as stdout and stderr may share their flags
+    for (i = 0; i < 3; i++) relay_free(&rl[i]);
+    return status;
+}
+
+// Checks a text reply. Failures are fatal unless warn is set.
+static void expect_v1(FILE *fp, const char *what, int warn, char **msg) {
+    int ret;
+
+    ret = parse_server_response(fp, msg);
     if (ret == -1) {
         fprintf(stderr, "Server returned unexpected response\n");
         exit(-1);
     } else if (ret == 0) {
-        fprintf(stderr, "Launch failed: %s\n", tmp);
-        exit(-1);
+        if (warn) {
+            fprintf(stderr, "Warning: %s: %s\n", what, *msg);
+        } else {
+            fprintf(stderr, "%s: %s\n", what, *msg);
+            exit(-1);
+        }
+    }
+}
+
+// The same for daemons which only speak text. The requests all go
+// out in one write and the replies are read back in order.
+static void launch_v1(FILE *fp, const char *pwd, char *pts_name,
+        char *argv[]) {
+    char *cwd, *msg;
+    int i, has_cwd;
+
+    fprintf(fp, "auth %s\n", pwd);
+
+    cwd = malloc(PATH_MAX);
+    has_cwd = cwd && getcwd(cwd, PATH_MAX);
+    if (has_cwd) {
+        fprintf(fp, "cd %s\n", cwd);
+    } else {
+        fprintf(stderr, "Warning: Could not get current working directory\n");
+    }
+    free(cwd);
+
+    fprintf(fp, "exec %s", pts_name);
+    for (i = 0; argv[i]; i++) {
+        fprintf(fp, " %s", argv[i]);
     }
+    if (fprintf(fp, "\n") < 0 || fflush(fp) == EOF) comm_failed();
+
+    expect_v1(fp, "Authentication failed", 0, &msg);
+    if (strncmp(msg, "Auth OK ", 8) == 0) save_ticket(msg + 8);
+
+    if (has_cwd) expect_v1(fp, "Unable to change directory", 1, &msg);
+    expect_v1(fp, "Launch failed", 0, &msg);
 }
 
 int pts_shell_main(int argc, char *argv[]) {
-    char buf[256], *buf2;
-    int sck, i, pts_fd;
+    char buf[256], pwd_buf[256], ticket_buf[128], *pwd, *ticket;
+    int i, pts_fd, sck, fds[4], *pass = NULL;
+    uint32_t flags = PROTO_F_TAKE_PTY;
+    struct reply r;
     FILE *fp;
 
+    // With --direct, the command gets our stdio rather than a PTS,
+    // and with -c it gets pipes which we relay
+    if (argc > 1 && strcmp(argv[1], "--direct") == 0) {
+        flags = PROTO_F_DIRECT;
+        argv++;
+        argc--;
+    } else if (argc > 1 && strcmp(argv[1], "-c") == 0) {
+        flags = PROTO_F_PIPES;
+        argv++;
+        argc--;
+    }
+
     // Check the arguments
     if (argc <= 1) {
         printf("No command specified?\n");
         return 1;
     }
 
-    // Show the user the command
-    printf("(pts-shell) ");
-    for (i = 1; i < argc; i++) {
-        printf("%s ", argv[i]);
+    if (flags & PROTO_F_DIRECT) {
+        fds[0] = STDIN_FILENO;
+        fds[1] = STDOUT_FILENO;
+        fds[2] = STDERR_FILENO;
+        fds[3] = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fds[3] < 0) {
+            perror("Could not open current working directory");
+            return -1;
+        }
+        pass = fds;
+    } else if (flags & PROTO_F_TAKE_PTY) {
+        // Show the user the command
+        printf("(pts-shell) ");
+        for (i = 1; i < argc; i++) {
+            printf("%s ", argv[i]);
+        }
+        printf("\n");
     }
-    printf("\n");
+
+    // Failed writes to the daemon are handled where they happen.
+    // pts_wrap() installs its own handler later.
+    signal(SIGPIPE, SIG_IGN);
 
     // Connect!
-    sck = unix_socket_connect("/dev/pts-daemon");
-    if (sck == -1) return -1;
+    sck = connect_daemon();
 
-    fp = fdopen(sck, "w+");
-    if (!fp) {
-        perror("fdopen");
-        close(sck);
-        return -1;
-    }
+    // Send whatever credentials we have along with the command.
+    // The password may be specified in the environment.
+    pwd = getenv("PTS_AUTH");
+    ticket = load_ticket(ticket_buf, sizeof(ticket_buf)) == 0 ? ticket_buf : NULL;
+    i = launch_v2(sck, 1, ticket, pwd, &argv[1], flags, pass, &r);
 
-    // See if the password is specified on the command line
-    buf2 = getenv("PTS_AUTH");
-    if (buf2) {
-        // User supplied password in the environment
-        authenticate(fp, buf2);
+    if (i == -2 && !(flags & PROTO_F_TAKE_PTY)) {
+        fprintf(stderr, "The daemon is too old for %s\n",
+                flags & PROTO_F_DIRECT ? "--direct" : "-c");
+        exit(-1);
+    } else if (i == -2) {
+        // Older daemon. Start over in text, on a PTS of our own.
+        close(sck);
+        pts_fd = pts_open(buf, sizeof(buf));
+        if (pts_fd < 0) {
+            perror("Error opening PTS device");
+            return -1;
+        }
+        fp = connect_daemon_v1();
+        if (!pwd) pwd = ask_password(pwd_buf, sizeof(pwd_buf));
+        launch_v1(fp, pwd, buf, &argv[1]);
+        fclose(fp);
     } else {
-        // Get the user's password
-        passwd_init_terminal();
-        printf("(pts-shell) Enter your password: ");
-        if (fgets(buf, sizeof(buf), stdin) == NULL) return -1;
-        passwd_deinit_terminal();
-        terminate_buf(buf, sizeof(buf));
-
-        authenticate(fp, buf);
-        memset(buf, '\0', sizeof(buf));
-    }
+        if (i == 0 && r.stage == PROTO_STAGE_AUTH && ticket) {
+            // Expired, or the password changed
+            forget_ticket();
+        }
 
-    // Send the daemon our current directory
-    buf2 = malloc(PATH_MAX);
-    if (getcwd(buf2, PATH_MAX)) {
-        fprintf(fp, "cd %s\n", buf2);
-        free(buf2);
+        // Neither trusted nor a good ticket, so we need the password
+        if (i == 0 && r.stage == PROTO_STAGE_AUTH && !pwd) {
+            pwd = ask_password(pwd_buf, sizeof(pwd_buf));
+            i = launch_v2(sck, 0, NULL, pwd, &argv[1], flags, pass, &r);
+        }
 
-        i = parse_server_response(fp, &buf2);
         if (i == -1) {
             fprintf(stderr, "Server returned unexpected response\n");
             exit(-1);
         } else if (i == 0) {
-            fprintf(stderr, "Warning: Unable to change directory: %s\n", buf2);
+            fprintf(stderr, "%s: %s\n", r.stage == PROTO_STAGE_AUTH ?
+                    "Authentication failed" : "Launch failed", r.msg);
+            exit(-1);
         }
-    } else {
-        free(buf2);
-        fprintf(stderr, "Warning: Could not get current working directory\n");
-    }
 
-    // Open a new PTS device
-    pts_fd = pts_open(buf, 256);
-    if (pts_fd < 0) {
-        perror("Error opening PTS device");
-        return -1;
-    }
+        // Newer daemons hand out a ticket for next time
+        if (r.ticket) save_ticket(r.ticket);
+        if (r.warning) fprintf(stderr, "Warning: %s\n", r.warning);
+        if (pwd == pwd_buf) memset(pwd_buf, '\0', sizeof(pwd_buf));
+
+        // Nothing to relay, the command has our stdio
+        if (flags & PROTO_F_DIRECT) return v2_read_exit(sck);
+
+        if (flags & PROTO_F_PIPES) {
+            if (!r.pipes || num_passed != 3) {
+                fprintf(stderr, "Launch failed: The pipes went missing\n");
+                exit(-1);
+            }
+            return relay_pipes(sck, passed_fds);
+        }
 
-    // Invoke the app
-    request_exec(fp, buf, &argv[1]);
-    fclose(fp);
+        // The daemon started the command on a PTY of its own
+        if (!r.ptm || num_passed != 1) {
+            fprintf(stderr, "Launch failed: The PTY went missing\n");
+            exit(-1);
+        }
+        pts_fd = passed_fds[0];
+        close(sck);
+    }
+    if (pwd == pwd_buf) memset(pwd_buf, '\0', sizeof(pwd_buf));
 
     // And call pts-wrap
     i = pts_wrap(pts_fd);
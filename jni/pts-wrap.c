@@ -14,81 +14,90 @@
  * limitations under the License.
  */
 
-#define _XOPEN_SOURCE
+#define _GNU_SOURCE
 
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <errno.h>
 #include <poll.h>
 #include <signal.h>
 #include <sys/ioctl.h>
+#include <sys/signalfd.h>
 #include "helpers.h"
+#include "relay.h"
+#include "uring.h"
 
 // Caught a signal which indicates we should quit
 static volatile int quit_requested = 0;
 // Caught sigwinch. Start at 1 so we send the SIGWINCH at the beginning
 static volatile int sigwinch_received = 1;
 
-// Handles polling for data to read. The data is then 
-// promptly written to stdout
-static int poll_pts(struct pollfd *pfd) {
-    unsigned char buf[256];
-    ssize_t blksz;
+// Signals arrive on this FD, so that the I/O loop can sleep in poll()
+// for as long as nothing happens. It's a signalfd, or if that's not
+// available, a pipe written to by the handlers.
+static int signal_fd = -1;
+static int signal_pipe = -1;    // The write end, for the handlers
+static sigset_t saved_mask;
 
-    if (pfd->revents & (POLLERR | POLLHUP | POLLNVAL)) {
-        return 1;
-    }
+// Moves output from the PTS device to stdout, as poll() allows
+// Returns 1 at EOF, -1 on failure, else 0
+static int poll_pts(struct pollfd *pfd, struct relay *r) {
+    int ret;
 
-    if (!(pfd->revents & POLLIN)) return 0;
-    
-    // Read the data
-    blksz = read(pfd->fd, buf, 256);
-    if (blksz == -1) {
-        perror("Error reading from PTS device");
-        return -1;
-    }
-    
-    // EOF
-    if (blksz == 0) return 1;
-
-    // Write the data
-    return write_to_fd(STDOUT_FILENO, buf, blksz);
+    ret = relay_events(r, pfd);
+    if (ret < 0) perror("Error relaying from PTS device");
+    return ret;
 }
 
-// Polls stdin for data, and prompty writes it to the tty
-static int poll_stdin(struct pollfd *pfd, int pts_fd) {
-    unsigned char buf[256];
-    ssize_t blksz;
+// The same, for input from stdin to the PTS device
+static int poll_stdin(struct pollfd *pfd, struct relay *r) {
+    int ret;
 
-    if (pfd->revents & (POLLERR | POLLHUP | POLLNVAL)) {
-        return 1;
-    }
+    ret = relay_events(r, pfd);
+    if (ret < 0) perror("Error relaying from stdin");
+    return ret;
+}
 
-    if (!(pfd->revents & POLLIN)) return 0;
+// Wakes up the I/O loop, if signals come through the pipe
+static void wake_loop(void) {
+    int saved = errno;
 
-    // Read the data
-    blksz = read(pfd->fd, buf, 256);
-    if (blksz == -1) {
-        perror("Error reading from stdin");
-        return -1;
+    if (signal_pipe >= 0 && write(signal_pipe, "", 1) < 0) {
+        // Full, so the loop has been woken up already
     }
-
-    // EOF
-    if (blksz == 0) return 1;
-
-    return write_to_fd(pts_fd, buf, blksz);
+    errno = saved;
 }
 
 // Handle a signal which should result in termination
 static void handle_quit_signals(int sig) {
     quit_requested = 1;
+    wake_loop();
 }
 
 // Handle a sigwinch
 static void handle_sigwinch(int sig) {
     sigwinch_received = 1;
+    wake_loop();
+}
+
+// Picks up the signals waiting on signal_fd
+static void read_signals(void) {
+    struct signalfd_siginfo si;
+    char buf[64];
+
+    if (signal_pipe >= 0) {
+        // The handlers have set the flags already
+        while (read(signal_fd, buf, sizeof(buf)) > 0);
+        return;
+    }
+
+    while (read(signal_fd, &si, sizeof(si)) == sizeof(si)) {
+        if (si.ssi_signo == SIGWINCH) sigwinch_received = 1;
+        else quit_requested = 1;
+    }
 }
 
 // Reads the current window size and
@@ -116,7 +125,27 @@ static int init_signals(void) {
     int quit_signals[] = { SIGALRM, SIGHUP, SIGPIPE, SIGQUIT, SIGTERM, SIGINT, 0 };
 
     struct sigaction act;
-    int i;
+    sigset_t mask;
+    int i, fds[2];
+
+    sigemptyset(&mask);
+    for (i = 0; quit_signals[i]; i++) sigaddset(&mask, quit_signals[i]);
+    sigaddset(&mask, SIGWINCH);
+
+    // Take them as a signalfd, blocking the usual delivery
+    if (sigprocmask(SIG_BLOCK, &mask, &saved_mask) == 0) {
+        signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+        if (signal_fd >= 0) return 0;
+        sigprocmask(SIG_SETMASK, &saved_mask, NULL);
+    }
+
+    // Or through a pipe from the handlers
+    if (pipe2(fds, O_NONBLOCK | O_CLOEXEC) < 0) {
+        perror("Error creating signal pipe");
+        return -1;
+    }
+    signal_fd = fds[0];
+    signal_pipe = fds[1];
 
     memset(&act, '\0', sizeof(act));
     act.sa_flags = SA_RESTART;
@@ -140,6 +169,23 @@ static int init_signals(void) {
     return 0;
 }
 
+// Undoes init_signals(), apart from the handlers. What came in
+// since the loop last looked is taken rather than let through, as
+// the handlers would have done.
+static void deinit_signals(void) {
+    int fd = signal_pipe;
+
+    if (fd >= 0) {
+        signal_pipe = -1;
+        close(fd);
+    } else {
+        read_signals();
+        sigprocmask(SIG_SETMASK, &saved_mask, NULL);
+    }
+    close(signal_fd);
+    signal_fd = -1;
+}
+
 // Set-up the terminal properly
 // Returns -1 on failure, 0 on success
 static int init_terminal(void) {
@@ -181,50 +227,287 @@ static void deinit_terminal(void) {
     }
 }
 
-// Wraps around a pts device like an SSH client
-int pts_wrap(int pts_fd) {
-    struct pollfd fds[2];
+// Most output taken per round of wrap_poll(), so that a flood of it
+// never keeps keystrokes waiting for long
+#define OUTPUT_BUDGET   (16 * 1024)
 
-    // PTS file descriptor
-    fds[0].fd = pts_fd;
-    fds[0].events = POLLIN;
-    fds[0].revents = 0;
+// Relays with poll(), until the session ends
+static void wrap_poll(int pts_fd) {
+    struct relay from_pts, from_stdin;
+    struct pollfd fds[5];
+    int stdin_done = 0;
 
-    // Stdin file descriptor
-    fds[1].fd = STDIN_FILENO;
-    fds[1].events = POLLIN;
-    fds[1].revents = 0;
-
-    // Install signal handlers
-    if (init_signals() != 0) return -1;
-
-    // Set up the terminal
-    init_terminal();
+    // Output goes from the PTS to stdout, input the other way
+    relay_init(&from_pts, pts_fd, STDOUT_FILENO);
+    relay_init(&from_stdin, STDIN_FILENO, pts_fd);
+    from_pts.budget = OUTPUT_BUDGET;
 
     // I/O loop to shove data
     while (!quit_requested) {
         int ret;
 
-        // Half a second timeout so we get a chance to respond to 
-        // SIGWINCH if nothing new is printed or the user doesn't 
-        // press anything on the keyboard
-        poll(fds, 2, 500);
+        if (sigwinch_received) {
+            sigwinch_received = 0;
+            update_winsize(STDOUT_FILENO, pts_fd);
+        }
+
+        // Each relay reads when it has room, and waits for its
+        // writer when output is held up
+        relay_poll(&from_pts, &fds[0]);
+        relay_poll(&from_stdin, &fds[2]);
+        if (stdin_done) fds[2].fd = fds[3].fd = -1;
+
+        // Signals wake us up too, so there's no need for a timeout
+        fds[4].fd = signal_fd;
+        fds[4].events = POLLIN;
+        if (poll(fds, 5, -1) < 0) continue;
+
+        if (fds[4].revents) read_signals();
+
+        // Input first, since somebody is waiting on it. Its end
+        // doesn't end the session, the PTS hanging up does, so the
+        // output is relayed until then.
+        if (!stdin_done) {
+            ret = poll_stdin(&fds[2], &from_stdin);
+            if (ret < 0) break;
+            if (ret) stdin_done = 1;
+        }
+
+        ret = poll_pts(&fds[0], &from_pts);
+        if (ret) break;
+    }
+
+    relay_free(&from_pts);
+    relay_free(&from_stdin);
+}
+
+#ifdef HAVE_URING
+
+// What a completion is for, in its user_data
+#define URING_OUT       0   // Output, from the PTS device to stdout
+#define URING_IN        1   // Input, from stdin to the PTS device
+#define URING_SIGNALS   2
+#define URING_WRITE     4   // Or'ed in for writes
+
+#define URING_BUF_SIZE  (64 * 1024)
+
+// Static, since a read the kernel is still cancelling when we're
+// done may land in them
+static char uring_bufs[2][URING_BUF_SIZE];
+
+struct uring_dir {
+    int from, to;
+    size_t len, off;        // Of what's being written
+};
+
+// Queues a read into the buffer for which, of URING_OUT or URING_IN
+static void queue_read(struct uring *u, struct uring_dir *d, int which,
+        int fixed) {
+    struct io_uring_sqe *sqe = uring_sqe(u);
+
+    sqe->opcode = fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+    sqe->fd = d->from;
+    sqe->off = -1;
+    sqe->addr = (uintptr_t) uring_bufs[which];
+    sqe->len = URING_BUF_SIZE;
+    sqe->buf_index = fixed ? which : 0;
+    sqe->user_data = which;
+}
+
+// Queues the write of the rest of the buffer, and the next read
+// into it, which the kernel starts once the write is done. A short
+// write cancels the read.
+static void queue_write(struct uring *u, struct uring_dir *d, int which,
+        int fixed) {
+    struct io_uring_sqe *sqe = uring_sqe(u);
+
+    sqe->opcode = fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+    sqe->fd = d->to;
+    sqe->off = -1;
+    sqe->addr = (uintptr_t) (uring_bufs[which] + d->off);
+    sqe->len = d->len - d->off;
+    sqe->buf_index = fixed ? which : 0;
+    sqe->flags = IOSQE_IO_LINK;
+    sqe->user_data = which | URING_WRITE;
+
+    queue_read(u, d, which, fixed);
+}
+
+static void queue_signals(struct uring *u) {
+    struct io_uring_sqe *sqe = uring_sqe(u);
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = signal_fd;
+    sqe->poll_events = POLLIN;
+    sqe->user_data = URING_SIGNALS;
+}
+
+#define URING_BATCH     8
+
+struct uring_done {
+    uint64_t data;
+    int32_t res;
+};
+
+// Handles one completion, queueing what comes next
+// Returns 1 when the session is over, 0 otherwise
+static int uring_complete(struct uring *u, struct uring_dir *dirs,
+        const struct uring_done *c, int fixed) {
+    int which = c->data & ~URING_WRITE;
+    int32_t res = c->res;
+
+    if (c->data == URING_SIGNALS) {
+        read_signals();
+        queue_signals(u);
+        return 0;
+    }
+
+    if (res == -EINTR || res == -EAGAIN) {
+        // Try that again
+        if (c->data & URING_WRITE) queue_write(u, &dirs[which], which, fixed);
+        else queue_read(u, &dirs[which], which, fixed);
+        return 0;
+    }
+
+    if (c->data & URING_WRITE) {
+        if (res <= 0) {
+            errno = res ? -res : EIO;
+            perror(which == URING_OUT ? "Error writing to stdout" :
+                    "Error writing to PTS device");
+            return 1;
+        }
+
+        // The rest goes out before the next read
+        dirs[which].off += res;
+        if (dirs[which].off < dirs[which].len) {
+            queue_write(u, &dirs[which], which, fixed);
+        }
+        return 0;
+    }
+
+    // Cancelled by a short write, and queued again with it
+    if (res == -ECANCELED) return 0;
+
+    // The end of the input isn't the end of the session. Nothing
+    // more is read from stdin, and the output is relayed until the
+    // PTS hangs up.
+    if (res == 0 && which == URING_IN) return 0;
+
+    // EOF, or for the PTS device, the slave side is gone
+    if (res <= 0) {
+        if (res < 0 && !(which == URING_OUT && res == -EIO)) {
+            errno = -res;
+            perror(which == URING_OUT ? "Error reading from PTS device" :
+                    "Error reading from stdin");
+        }
+        return 1;
+    }
+
+    dirs[which].len = res;
+    dirs[which].off = 0;
+    queue_write(u, &dirs[which], which, fixed);
+    return 0;
+}
+
+// Relays with io_uring, which keeps a read posted on both sides at
+// all times. Each direction has one buffer, which the kernel reads
+// into and then writes out of, so there is one system call per round
+// of completions, and nothing to copy when the buffers can be
+// registered.
+// Returns -1 if io_uring isn't available, or 0 when the session ends
+static int wrap_uring(int pts_fd) {
+    struct uring_done batch[URING_BATCH];
+    struct uring_dir dirs[2];
+    struct io_uring_cqe *cqe;
+    struct iovec iov[2];
+    struct uring u;
+    int i, n, pass, fixed, done = 0;
+
+    if (uring_init(&u, 8) < 0) return -1;
+
+    // Reads at the file position (for a stdin redirected from a
+    // file) came in with the plain READ and WRITE, in 5.6
+    if (!(u.features & IORING_FEAT_RW_CUR_POS)) {
+        uring_free(&u);
+        return -1;
+    }
 
-        ret = poll_pts(&fds[0]);
-        if (ret == 1 || ret != 0) break;
+    dirs[URING_OUT].from = pts_fd;
+    dirs[URING_OUT].to = STDOUT_FILENO;
+    dirs[URING_IN].from = STDIN_FILENO;
+    dirs[URING_IN].to = pts_fd;
 
-        ret = poll_stdin(&fds[1], pts_fd);
-        if (ret == 1 || ret != 0) break;
+    // Registered buffers stay mapped in the kernel, if the memlock
+    // limit allows it
+    for (i = 0; i < 2; i++) {
+        iov[i].iov_base = uring_bufs[i];
+        iov[i].iov_len = URING_BUF_SIZE;
+    }
+    fixed = uring_register_buffers(&u, iov, 2) == 0;
+
+    queue_read(&u, &dirs[URING_OUT], URING_OUT, fixed);
+    queue_read(&u, &dirs[URING_IN], URING_IN, fixed);
+    queue_signals(&u);
 
+    while (!quit_requested && !done) {
         if (sigwinch_received) {
             sigwinch_received = 0;
             update_winsize(STDOUT_FILENO, pts_fd);
         }
+
+        if (uring_submit(&u, 1) < 0 && errno != EINTR) {
+            perror("io_uring_enter() failed");
+            break;
+        }
+
+        for (n = 0; n < URING_BATCH && (cqe = uring_cqe(&u)); n++) {
+            batch[n].data = cqe->user_data;
+            batch[n].res = cqe->res;
+            uring_seen(&u);
+        }
+
+        // Input and signals first, so that a keystroke's write goes
+        // in ahead of the output's
+        for (pass = 0; pass < 2; pass++) {
+            for (i = 0; i < n; i++) {
+                if (((batch[i].data & ~URING_WRITE) == URING_OUT) != pass) continue;
+                done |= uring_complete(&u, dirs, &batch[i], fixed);
+            }
+        }
     }
 
-    // Reset terminal
+    // Which cancels whatever is still in flight
+    uring_free(&u);
+    return 0;
+}
+
+#else
+
+static int wrap_uring(int pts_fd) {
+    return -1;
+}
+
+#endif
+
+// Wraps around a pts device like an SSH client. With PTS_IO_URING
+// set in the environment, io_uring does the relaying where the
+// kernel has it.
+int pts_wrap(int pts_fd) {
+    // Install signal handlers
+    if (init_signals() != 0) return -1;
+
+    // Set up the terminal
+    init_terminal();
+
+    if (!getenv("PTS_IO_URING") || wrap_uring(pts_fd) < 0) {
+        wrap_poll(pts_fd);
+    }
+
+    // Reset terminal, before any signal can get through
     deinit_terminal();
 
+    deinit_signals();
+
     return 0;
 }
 
@@ -0,0 +1,98 @@
+/*
+ * Copyright 2013, Tan Chee Eng (@tan-ce)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * PTYs opened ahead of time
+ *
+ * The pool is a stack, so the PTY taken is the one opened last.
+ * Masters nobody has taken stay open with nothing on the slave side,
+ * which costs a devpts entry and nothing else.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "helpers.h"
+#include "ptypool.h"
+
+struct pty {
+    int ptm, pts;
+};
+
+static struct pty *ptys = NULL;
+static int num_ptys = 0, max_ptys = 0;
+static int dirty = 1;       // The pool may be short of PTYs
+
+// Keep this many PTYs ready. 0 turns the pool off.
+// Returns -1 if out of memory
+int ptypool_init(int count) {
+    if (count <= 0) return 0;
+
+    ptys = calloc(count, sizeof(*ptys));
+    if (!ptys) return -1;
+    max_ptys = count;
+    return 0;
+}
+
+// Opens a PTY, master and slave
+// Returns -1 on failure
+static int pty_open(struct pty *p) {
+    char name[32];
+
+    p->ptm = pts_open(name, sizeof(name));
+    if (p->ptm < 0) return -1;
+
+    // Held by us, the slave doesn't have to be found by name later
+    p->pts = open(name, O_RDWR | O_NOCTTY | O_CLOEXEC);
+    if (p->pts < 0) {
+        close(p->ptm);
+        return -1;
+    }
+    return 0;
+}
+
+// Hands over a PTY, with the slave in *pts. Falls back to opening
+// one if the pool has run dry. Both are close-on-exec.
+// Returns the master, or -1 on failure
+int ptypool_take(int *pts) {
+    struct pty p;
+
+    dirty = 1;
+    if (num_ptys) p = ptys[--num_ptys];
+    else if (pty_open(&p) < 0) return -1;
+
+    *pts = p.pts;
+    return p.ptm;
+}
+
+// Opens PTYs until the pool is full. Call from the event loop.
+// Does nothing unless a PTY was taken since last time.
+void ptypool_fill(void) {
+    if (!dirty) return;
+    dirty = 0;
+
+    while (num_ptys < max_ptys) {
+        if (pty_open(&ptys[num_ptys]) < 0) {
+            // Out of PTYs, most likely. Try again after the next take.
+            perror("ptypool: Unable to open a PTY");
+            return;
+        }
+        num_ptys++;
+    }
+}
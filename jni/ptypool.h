@@ -0,0 +1,39 @@
+/*
+ * Copyright 2013, Tan Chee Eng (@tan-ce)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * PTYs opened ahead of time, both master and slave, so that the
+ * launch path only has to pop one. The pool is topped up from the
+ * event loop.
+ */
+
+#ifndef _PTYPOOL_H_
+#define _PTYPOOL_H_
+
+// Keep this many PTYs ready. 0 turns the pool off.
+// Returns -1 if out of memory
+int ptypool_init(int count);
+
+// Hands over a PTY, with the slave in *pts. Falls back to opening
+// one if the pool has run dry. Both are close-on-exec.
+// Returns the master, or -1 on failure
+int ptypool_take(int *pts);
+
+// Opens PTYs until the pool is full. Call from the event loop.
+// Does nothing unless a PTY was taken since last time.
+void ptypool_fill(void);
+
+#endif
@@ -0,0 +1,470 @@
+/*
+ * Copyright 2013, Tan Chee Eng (@tan-ce)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * Descriptor to descriptor relay
+ *
+ * splice() needs a pipe on one side. When from or to is a pipe
+ * already, data is spliced straight across. Otherwise (say from a
+ * PTY master to a terminal) it goes through a pipe of our own, into
+ * which it's spliced and then out of again. Kernels which can't
+ * splice a given file (older ones for TTYs, or an O_APPEND stdout)
+ * say EINVAL, and the relay then copies through a ring buffer from
+ * there on.
+ *
+ * A PTY master gives up at most a few KB per read, so under a
+ * burst of output the relay keeps reading for as long as more is
+ * ready, and writes it all at once. Keystrokes come one read at a
+ * time and go straight through. Our pipe and the ring grow while
+ * the reads keep filling them. The ring shrinks again when the
+ * traffic dies down. The pipe needn't, as a pipe only holds pages
+ * for what's in it.
+ *
+ * A budget caps what one relay_events() takes in, so that a caller
+ * with several relays gets back to the others in good time.
+ *
+ * Writes are non-blocking. What the writer won't take yet stays in
+ * our pipe or the ring, or in the source pipe when splicing straight
+ * across, and goes out when it polls writable. While RELAY_MAX_HELD
+ * is held the relay stops reading, which pushes back on the source.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "relay.h"
+
+#define RELAY_DIRECT    0   // splice() from one to the other
+#define RELAY_PIPE      1   // splice() through r->pipe
+#define RELAY_COPY      2   // readv() and writev() through r->buf
+
+// Smallest the ring gets
+#define MIN_BUF         1024
+
+// A read smaller than this was typing, so don't look for more
+#define COALESCE_MIN    512
+
+// Shrink the ring after this many reads which used a quarter of it
+#define SHRINK_AFTER    16
+
+static int is_pipe(int fd) {
+    struct stat st;
+
+    return fstat(fd, &st) == 0 && S_ISFIFO(st.st_mode);
+}
+
+// Whether fd can be read right now
+static int readable(int fd) {
+    struct pollfd pfd;
+
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    return poll(&pfd, 1, 0) == 1 && (pfd.revents & POLLIN);
+}
+
+// How much more r may take, having taken got
+static size_t allowance(const struct relay *r, size_t got) {
+    return r->budget ? r->budget - got : (size_t) -1;
+}
+
+// Cuts the n pieces in iov down to len bytes
+// Returns the number of pieces left
+static int iov_limit(struct iovec *iov, int n, size_t len) {
+    int i;
+
+    for (i = 0; i < n; i++) {
+        if (iov[i].iov_len >= len) {
+            iov[i].iov_len = len;
+            return i + 1;
+        }
+        len -= iov[i].iov_len;
+    }
+    return n;
+}
+
+// Whether a splice() error means the files don't support it
+static int cant_splice(int err) {
+    return err == EINVAL || err == ENOSYS;
+}
+
+void relay_init(struct relay *r, int from, int to) {
+    int flags;
+
+    memset(r, '\0', sizeof(*r));
+    r->from = from;
+    r->to = to;
+    r->pipe[0] = r->pipe[1] = -1;
+
+    // Writes mustn't block
+    r->to_flags = -1;
+    flags = fcntl(to, F_GETFL);
+    if (flags >= 0 && !(flags & O_NONBLOCK) &&
+            fcntl(to, F_SETFL, flags | O_NONBLOCK) == 0) {
+        r->to_flags = flags;
+    }
+
+    if (is_pipe(from) || is_pipe(to)) {
+        r->mode = RELAY_DIRECT;
+    } else if (pipe2(r->pipe, O_CLOEXEC) == 0) {
+        r->mode = RELAY_PIPE;
+        r->pipe_size = fcntl(r->pipe[1], F_GETPIPE_SZ);
+        if (r->pipe_size <= 0) r->pipe_size = 4096;
+    } else {
+        r->mode = RELAY_COPY;
+    }
+}
+
+void relay_free(struct relay *r) {
+    if (r->to_flags >= 0) fcntl(r->to, F_SETFL, r->to_flags);
+    r->to_flags = -1;
+    if (r->pipe[0] >= 0) {
+        close(r->pipe[0]);
+        close(r->pipe[1]);
+    }
+    r->pipe[0] = r->pipe[1] = -1;
+    free(r->buf);
+    r->buf = NULL;
+    r->buf_size = r->held = 0;
+}
+
+// The free part of the ring, in up to two pieces
+// Returns the number of pieces
+static int ring_space(const struct relay *r, struct iovec *iov) {
+    size_t end = r->buf_start + r->held;
+
+    if (r->held == r->buf_size) return 0;
+    if (end >= r->buf_size) {
+        end -= r->buf_size;
+        iov[0].iov_base = r->buf + end;
+        iov[0].iov_len = r->buf_start - end;
+        return 1;
+    }
+
+    iov[0].iov_base = r->buf + end;
+    iov[0].iov_len = r->buf_size - end;
+    if (!r->buf_start) return 1;
+    iov[1].iov_base = r->buf;
+    iov[1].iov_len = r->buf_start;
+    return 2;
+}
+
+// The held part of the ring, the same way
+static int ring_held(const struct relay *r, struct iovec *iov) {
+    size_t end = r->buf_start + r->held;
+
+    if (!r->held) return 0;
+    iov[0].iov_base = r->buf + r->buf_start;
+    if (end <= r->buf_size) {
+        iov[0].iov_len = r->held;
+        return 1;
+    }
+
+    iov[0].iov_len = r->buf_size - r->buf_start;
+    iov[1].iov_base = r->buf;
+    iov[1].iov_len = end - r->buf_size;
+    return 2;
+}
+
+// Moves the ring to a new buffer of size bytes, which has to be
+// large enough for what's held
+// Returns -1 if out of memory
+static int resize_ring(struct relay *r, size_t size) {
+    struct iovec iov[2];
+    char *tmp;
+    int i, n;
+
+    tmp = malloc(size);
+    if (!tmp) return -1;
+
+    n = ring_held(r, iov);
+    for (i = 0; i < n; i++) {
+        memcpy(tmp + (i ? iov[0].iov_len : 0), iov[i].iov_base, iov[i].iov_len);
+    }
+
+    free(r->buf);
+    r->buf = tmp;
+    r->buf_size = size;
+    r->buf_start = 0;
+    return 0;
+}
+
+// Shrinks the ring once a run of reads has used little of it
+static void adapt_buf(struct relay *r, size_t used) {
+    if (used > r->buf_size / 4 || r->buf_size <= MIN_BUF) {
+        r->small_reads = 0;
+        return;
+    }
+    if (++r->small_reads < SHRINK_AFTER) return;
+
+    r->small_reads = 0;
+    if (r->held <= r->buf_size / 2) resize_ring(r, r->buf_size / 2);
+}
+
+// Reads what's ready on fd into the ring
+// Returns the number of bytes read, 0 at EOF, or -1 with errno set
+static ssize_t ring_take(struct relay *r, int fd) {
+    struct iovec iov[2];
+    size_t got = 0;
+    ssize_t ret;
+
+    if (!r->buf && resize_ring(r, MIN_BUF) < 0) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    while (1) {
+        // Full, and there's more coming
+        if (r->held == r->buf_size && (r->buf_size >= RELAY_MAX_HELD ||
+                    resize_ring(r, r->buf_size * 2) < 0)) {
+            r->full = 1;
+            break;
+        }
+
+        ret = readv(fd, iov, iov_limit(iov, ring_space(r, iov),
+                    allowance(r, got)));
+        if (ret < 0 && errno == EINTR) continue;
+
+        // An error or EOF after some data is reported next time
+        if (ret <= 0) {
+            if (got) break;
+            return ret;
+        }
+        got += ret;
+        r->held += ret;
+
+        if (got < COALESCE_MIN || !allowance(r, got) || !readable(fd)) break;
+    }
+
+    if (!got) {
+        errno = EAGAIN;
+        return -1;
+    }
+    adapt_buf(r, got);
+    return got;
+}
+
+// Writes what it can of the ring
+// Returns -1 on failure
+static int ring_flush(struct relay *r) {
+    struct iovec iov[2];
+    ssize_t ret;
+
+    while (r->held) {
+        ret = writev(r->to, iov, ring_held(r, iov));
+        if (ret < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN) return 0;
+            return -1;
+        }
+        r->buf_start = (r->buf_start + ret) % r->buf_size;
+        r->held -= ret;
+        r->full = 0;
+    }
+    r->buf_start = 0;
+    return 0;
+}
+
+// Gives up on splice(), moving whatever is in our pipe to the ring
+// Returns -1 on failure
+static int fall_back(struct relay *r) {
+    size_t size = MIN_BUF, held = r->held;
+    ssize_t ret;
+
+    while (size < held) size *= 2;
+    r->held = 0;
+    if (resize_ring(r, size) < 0) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    while (r->held < held) {
+        ret = read(r->pipe[0], r->buf + r->held, held - r->held);
+        if (ret < 0 && errno == EINTR) continue;
+        if (ret <= 0) return -1;
+        r->held += ret;
+    }
+
+    if (r->pipe[0] >= 0) {
+        close(r->pipe[0]);
+        close(r->pipe[1]);
+        r->pipe[0] = r->pipe[1] = -1;
+    }
+    r->mode = RELAY_COPY;
+    return ring_flush(r);
+}
+
+// Doubles our pipe, up to RELAY_MAX_HELD
+// Returns -1 if it can't grow
+static int grow_pipe(struct relay *r) {
+    int size;
+
+    if (r->pipe_size >= RELAY_MAX_HELD) return -1;
+    size = fcntl(r->pipe[1], F_SETPIPE_SZ, r->pipe_size * 2);
+    if (size <= r->pipe_size) return -1;
+    r->pipe_size = size;
+    return 0;
+}
+
+// Splices what's ready into our pipe
+// Returns the number of bytes taken, 0 at EOF, or -1 with errno set
+static ssize_t pipe_take(struct relay *r) {
+    size_t got = 0, len;
+    ssize_t ret;
+
+    while (1) {
+        if (r->held >= (size_t) r->pipe_size && grow_pipe(r) < 0) {
+            r->full = 1;
+            break;
+        }
+
+        len = r->pipe_size - r->held;
+        if (len > allowance(r, got)) len = allowance(r, got);
+        ret = splice(r->from, NULL, r->pipe[1], NULL, len,
+                SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (ret < 0 && errno == EINTR) continue;
+
+        // Pages which are partly used may fill our pipe before held
+        // says so. With nothing held, it's the source that's empty.
+        if (ret < 0 && errno == EAGAIN && r->held) {
+            if (grow_pipe(r) == 0) continue;
+            r->full = 1;
+            break;
+        }
+
+        // An error or EOF after some data is reported next time
+        if (ret <= 0) {
+            if (got) break;
+            return ret;
+        }
+        got += ret;
+        r->held += ret;
+
+        if (got < COALESCE_MIN || !allowance(r, got) || !readable(r->from)) {
+            break;
+        }
+    }
+
+    if (!got) {
+        errno = EAGAIN;
+        return -1;
+    }
+    return got;
+}
+
+// Splices what it can out of our pipe
+// Returns -1 on failure
+static int pipe_flush(struct relay *r) {
+    ssize_t ret;
+
+    while (r->held) {
+        ret = splice(r->pipe[0], NULL, r->to, NULL, r->held,
+                SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (ret < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN) return 0;
+            if (cant_splice(errno)) return fall_back(r);
+            return -1;
+        }
+        r->held -= ret;
+        r->full = 0;
+    }
+    return 0;
+}
+
+// Takes in what's ready on r->from
+// Returns the number of bytes taken, 0 at EOF, or -1 with errno set
+static ssize_t take(struct relay *r) {
+    size_t len = RELAY_CHUNK;
+    ssize_t ret;
+
+    if (len > allowance(r, 0)) len = allowance(r, 0);
+
+    while (1) {
+        switch (r->mode) {
+            case RELAY_DIRECT:
+                // Whatever isn't taken stays in the source pipe
+                ret = splice(r->from, NULL, r->to, NULL, len,
+                        SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+                if (ret < 0 && errno == EAGAIN) r->full = 1;
+                break;
+            case RELAY_PIPE:
+                ret = pipe_take(r);
+                break;
+            default:
+                ret = ring_take(r, r->from);
+                break;
+        }
+
+        if (ret >= 0 || r->mode == RELAY_COPY || !cant_splice(errno)) {
+            return ret;
+        }
+        if (fall_back(r) < 0) return -1;
+    }
+}
+
+// Writes what it can of what's held
+// Returns -1 on failure
+static int flush(struct relay *r) {
+    switch (r->mode) {
+        case RELAY_DIRECT:
+            // Try again when the source is next readable
+            r->full = 0;
+            return 0;
+        case RELAY_PIPE:
+            return pipe_flush(r);
+        default:
+            return ring_flush(r);
+    }
+}
+
+void relay_poll(const struct relay *r, struct pollfd *pfd) {
+    pfd[0].fd = r->eof || r->full ? -1 : r->from;
+    pfd[0].events = POLLIN;
+    pfd[0].revents = 0;
+
+    pfd[1].fd = r->held || r->full ? r->to : -1;
+    pfd[1].events = POLLOUT;
+    pfd[1].revents = 0;
+}
+
+int relay_events(struct relay *r, const struct pollfd *pfd) {
+    ssize_t ret;
+
+    // Make room first
+    if (pfd[1].fd >= 0 && pfd[1].revents && flush(r) < 0) return -1;
+
+    if (pfd[0].fd >= 0 && pfd[0].revents && !r->full) {
+        ret = take(r);
+        if (ret > 0) {
+            if (flush(r) < 0) return -1;
+        } else if (ret == 0) {
+            r->eof = 1;
+        } else if (errno != EAGAIN && errno != EINTR) {
+            // A PTY master whose slave is gone says EIO
+            if (!(pfd[0].revents & POLLHUP)) return -1;
+            r->eof = 1;
+        }
+    }
+
+    return r->eof && !r->held ? 1 : 0;
+}
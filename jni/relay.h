@@ -0,0 +1,75 @@
+/*
+ * Copyright 2013, Tan Chee Eng (@tan-ce)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * Moves data from one descriptor to another without it passing
+ * through user space, where the kernel lets us. Neither direction
+ * ever blocks: output which can't be written yet is held, up to a
+ * limit, and reading stops while it's full.
+ */
+
+#ifndef _RELAY_H_
+#define _RELAY_H_
+
+#include <poll.h>
+#include <sys/types.h>
+
+// How much is spliced straight across at a time
+#define RELAY_CHUNK     (64 * 1024)
+
+// Most a relay holds for a stalled writer
+#define RELAY_MAX_HELD  (256 * 1024)
+
+struct relay {
+    int from, to;
+    int to_flags;           // To put back, or -1 if unchanged
+    int mode;               // RELAY_*, see relay.c
+    int full;               // No room for more until r->to takes some
+    int eof;                // r->from is done
+    size_t budget;          // Most taken per relay_events(), 0 for no
+                            // limit. Set it after relay_init().
+
+    // What's held for r->to, in our pipe or the ring
+    size_t held;
+
+    int pipe[2];            // Between from and to, for splice()
+    int pipe_size;          // Which grows with the traffic
+
+    char *buf;              // Ring for copying, allocated when needed
+    size_t buf_size;        // And sized to the traffic
+    size_t buf_start;
+    int small_reads;        // In a row, see adapt_buf()
+};
+
+// Sets up r to move data from from to to. to is made non-blocking
+// until relay_free().
+void relay_init(struct relay *r, int from, int to);
+
+// Fills in pfd[0] and pfd[1] for poll(), for r->from when there's
+// room for input and for r->to when output is held up. Either may
+// be left out, with a fd of -1.
+void relay_poll(const struct relay *r, struct pollfd *pfd);
+
+// Acts on what poll() said about the pfd from relay_poll(). A burst
+// of input is gathered up and written in one go, or held.
+// Returns 1 once r->from has ended and everything read from it has
+// been written, -1 on failure with errno set, or 0.
+int relay_events(struct relay *r, const struct pollfd *pfd);
+
+// Frees what relay_init() set up. The two descriptors are left open.
+void relay_free(struct relay *r);
+
+#endif
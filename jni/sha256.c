@@ -0,0 +1,176 @@
+/*
+ * Copyright 2013, Tan Chee Eng (@tan-ce)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+/**
+ * SHA-256 (FIPS 180-4) and HMAC-SHA256 (RFC 2104)
+ */
+
+#include <string.h>
+
+#include "sha256.h"
+
+static const uint32_t K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+    0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+    0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+    0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+    0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+    0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROR(x, n)   (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256_block(sha256_ctx *ctx, const uint8_t *p) {
+    uint32_t w[64], a, b, c, d, e, f, g, h, t1, t2;
+    int i;
+
+    for (i = 0; i < 16; i++) {
+        w[i] = (uint32_t) p[4 * i] << 24 | (uint32_t) p[4 * i + 1] << 16 |
+               (uint32_t) p[4 * i + 2] << 8 | p[4 * i + 3];
+    }
+    for (; i < 64; i++) {
+        w[i] = w[i - 16] + w[i - 7] +
+               (ROR(w[i - 15], 7) ^ ROR(w[i - 15], 18) ^ (w[i - 15] >> 3)) +
+               (ROR(w[i - 2], 17) ^ ROR(w[i - 2], 19) ^ (w[i - 2] >> 10));
+    }
+
+    a = ctx->h[0]; b = ctx->h[1]; c = ctx->h[2]; d = ctx->h[3];
+    e = ctx->h[4]; f = ctx->h[5]; g = ctx->h[6]; h = ctx->h[7];
+
+    for (i = 0; i < 64; i++) {
+        t1 = h + (ROR(e, 6) ^ ROR(e, 11) ^ ROR(e, 25)) +
+             ((e & f) ^ (~e & g)) + K[i] + w[i];
+        t2 = (ROR(a, 2) ^ ROR(a, 13) ^ ROR(a, 22)) +
+             ((a & b) ^ (a & c) ^ (b & c));
+        h = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+
+    ctx->h[0] += a; ctx->h[1] += b; ctx->h[2] += c; ctx->h[3] += d;
+    ctx->h[4] += e; ctx->h[5] += f; ctx->h[6] += g; ctx->h[7] += h;
+
+    memset(w, 0, sizeof(w));
+}
+
+void sha256_init(sha256_ctx *ctx) {
+    static const uint32_t iv[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+
+    memcpy(ctx->h, iv, sizeof(iv));
+    ctx->len = 0;
+}
+
+void sha256_update(sha256_ctx *ctx, const void *data, size_t len) {
+    const uint8_t *p = data;
+    size_t used = ctx->len % SHA256_BLOCK_SIZE, n;
+
+    ctx->len += len;
+
+    // Top up a partial block first
+    if (used) {
+        n = SHA256_BLOCK_SIZE - used;
+        if (n > len) n = len;
+        memcpy(ctx->buf + used, p, n);
+        p += n;
+        len -= n;
+        if (used + n < SHA256_BLOCK_SIZE) return;
+        sha256_block(ctx, ctx->buf);
+    }
+
+    while (len >= SHA256_BLOCK_SIZE) {
+        sha256_block(ctx, p);
+        p += SHA256_BLOCK_SIZE;
+        len -= SHA256_BLOCK_SIZE;
+    }
+
+    memcpy(ctx->buf, p, len);
+}
+
+void sha256_final(sha256_ctx *ctx, uint8_t digest[SHA256_DIGEST_SIZE]) {
+    uint64_t bits = ctx->len * 8;
+    uint8_t pad[SHA256_BLOCK_SIZE + 8];
+    size_t padlen;
+    int i;
+
+    // 0x80, zeroes up to 56 mod 64, then the length in bits
+    padlen = SHA256_BLOCK_SIZE - (ctx->len + 8) % SHA256_BLOCK_SIZE;
+    memset(pad, 0, sizeof(pad));
+    pad[0] = 0x80;
+    for (i = 0; i < 8; i++) pad[padlen + i] = bits >> (56 - 8 * i);
+    sha256_update(ctx, pad, padlen + 8);
+
+    for (i = 0; i < 8; i++) {
+        digest[4 * i] = ctx->h[i] >> 24;
+        digest[4 * i + 1] = ctx->h[i] >> 16;
+        digest[4 * i + 2] = ctx->h[i] >> 8;
+        digest[4 * i + 3] = ctx->h[i];
+    }
+
+    memset(ctx, 0, sizeof(*ctx));
+}
+
+void hmac_sha256_init(hmac_sha256_ctx *ctx, const void *key, size_t len) {
+    uint8_t k[SHA256_BLOCK_SIZE];
+    int i;
+
+    // Long keys are hashed down to size
+    memset(k, 0, sizeof(k));
+    if (len > SHA256_BLOCK_SIZE) {
+        sha256_init(&ctx->inner);
+        sha256_update(&ctx->inner, key, len);
+        sha256_final(&ctx->inner, k);
+    } else {
+        memcpy(k, key, len);
+    }
+
+    for (i = 0; i < SHA256_BLOCK_SIZE; i++) k[i] ^= 0x36;
+    sha256_init(&ctx->inner);
+    sha256_update(&ctx->inner, k, sizeof(k));
+
+    for (i = 0; i < SHA256_BLOCK_SIZE; i++) k[i] ^= 0x36 ^ 0x5c;
+    sha256_init(&ctx->outer);
+    sha256_update(&ctx->outer, k, sizeof(k));
+
+    memset(k, 0, sizeof(k));
+}
+
+void hmac_sha256_update(hmac_sha256_ctx *ctx, const void *data, size_t len) {
+    sha256_update(&ctx->inner, data, len);
+}
+
+void hmac_sha256_final(hmac_sha256_ctx *ctx,
+        uint8_t digest[SHA256_DIGEST_SIZE]) {
+    uint8_t inner[SHA256_DIGEST_SIZE];
+
+    sha256_final(&ctx->inner, inner);
+    sha256_update(&ctx->outer, inner, sizeof(inner));
+    sha256_final(&ctx->outer, digest);
+
+    memset(inner, 0, sizeof(inner));
+}
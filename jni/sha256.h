@@ -0,0 +1,51 @@
+/*
+ * Copyright 2013, Tan Chee Eng (@tan-ce)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+/**
+ * SHA-256 and HMAC-SHA256, for keying things the daemon must not
+ * keep or hand out in the clear
+ */
+
+#ifndef _SHA256_H_
+#define _SHA256_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHA256_BLOCK_SIZE   64
+#define SHA256_DIGEST_SIZE  32
+
+typedef struct {
+    uint32_t h[8];
+    uint64_t len;           // Bytes hashed so far
+    uint8_t buf[SHA256_BLOCK_SIZE];
+} sha256_ctx;
+
+typedef struct {
+    sha256_ctx inner, outer;
+} hmac_sha256_ctx;
+
+void sha256_init(sha256_ctx *ctx);
+void sha256_update(sha256_ctx *ctx, const void *data, size_t len);
+void sha256_final(sha256_ctx *ctx, uint8_t digest[SHA256_DIGEST_SIZE]);
+
+void hmac_sha256_init(hmac_sha256_ctx *ctx, const void *key, size_t len);
+void hmac_sha256_update(hmac_sha256_ctx *ctx, const void *data, size_t len);
+void hmac_sha256_final(hmac_sha256_ctx *ctx,
+        uint8_t digest[SHA256_DIGEST_SIZE]);
+
+#endif
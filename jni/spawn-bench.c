@@ -0,0 +1,135 @@
+/*
+ * Copyright 2013, Tan Chee Eng (@tan-ce)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Times launches onto a PTS with fork() and with pts_spawn(), from a
+// parent holding a given amount of touched memory, like a daemon that
+// has been up for a while. Built and run by "make bench", x86 only.
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <termios.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/ioctl.h>
+
+pid_t pts_spawn(int pts_fd, char **cmd_argv, char **env, int cwd_fd,
+        const struct termios *tio, const struct winsize *ws,
+        const char **failed);
+
+static char *cmd_argv[] = { "/bin/true", NULL };
+extern char **environ;
+
+static double now_us(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+// What the daemon did before pts_spawn(): fork(), then set up the
+// terminal in the child
+static pid_t fork_launch(int pts_fd) {
+    pid_t pid = fork();
+    int i;
+
+    if (pid) return pid;
+
+    setsid();
+    ioctl(pts_fd, TIOCSCTTY, 0);
+    for (i = 0; i < 3; i++) dup2(pts_fd, i);
+    execve(cmd_argv[0], cmd_argv, environ);
+    _exit(127);
+}
+
+static pid_t spawn_launch(int pts_fd) {
+    return pts_spawn(pts_fd, cmd_argv, NULL, -1, NULL, NULL, NULL);
+}
+
+// Launches n times, waiting for each. Prints the average time the
+// caller is held up and the average time to a reaped child.
+static int run(const char *name, pid_t (*launch)(int), int pts_fd, int n) {
+    double start, blocked = 0, total;
+    int i;
+    pid_t pid;
+
+    start = now_us();
+    for (i = 0; i < n; i++) {
+        double t = now_us();
+
+        pid = launch(pts_fd);
+        blocked += now_us() - t;
+        if (pid < 0) {
+            perror(name);
+            return -1;
+        }
+        waitpid(pid, NULL, 0);
+    }
+    total = now_us() - start;
+
+    printf("  %-6s %8.0f us/launch, caller blocked %6.0f us\n",
+            name, total / n, blocked / n);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    int ptm, pts_fd, n = 200, i;
+    char *mem;
+    size_t mb;
+
+    if (argc > 2 && strcmp(argv[1], "-n") == 0) {
+        n = atoi(argv[2]);
+        argv += 2;
+        argc -= 2;
+    }
+    if (n <= 0 || argc < 2) {
+        printf("Usage: spawn-bench [-n <launches>] <MB> ...\n");
+        return 1;
+    }
+
+    ptm = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+    if (ptm < 0 || grantpt(ptm) < 0 || unlockpt(ptm) < 0 ||
+            (pts_fd = open(ptsname(ptm), O_RDWR | O_NOCTTY | O_CLOEXEC)) < 0) {
+        perror("Failed to open a PTS");
+        return 1;
+    }
+
+    printf("%d launches of %s\n", n, cmd_argv[0]);
+    for (i = 1; i < argc; i++) {
+        mb = strtoul(argv[i], NULL, 10);
+        mem = malloc(mb << 20);
+        if (mb && !mem) {
+            perror("malloc");
+            return 1;
+        }
+        memset(mem, 1, mb << 20);
+
+        printf("%zu MB resident:\n", mb);
+        if (run("fork", fork_launch, pts_fd, n) < 0 ||
+                run("spawn", spawn_launch, pts_fd, n) < 0)
+            return 1;
+        free(mem);
+    }
+
+    close(pts_fd);
+    close(ptm);
+    return 0;
+}
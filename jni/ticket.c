@@ -0,0 +1,116 @@
+/*
+ * Copyright 2013, Tan Chee Eng (@tan-ce)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+/**
+ * Tickets look like <expiry>.<nonce>.<mac>, all in hex. The MAC is
+ * an HMAC-SHA256 over the uid, expiry, nonce and password hash,
+ * under a key which only lives in the daemon's memory.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <inttypes.h>
+
+#include "ticket.h"
+#include "sha256.h"
+#include "bcrypt.h"
+
+static uint8_t ticket_key[SHA256_DIGEST_SIZE];
+static int ticket_lifetime = 0;
+
+// Seconds since boot, counting time spent suspended
+static unsigned long now(void) {
+    struct timespec ts;
+
+#ifdef CLOCK_BOOTTIME
+    if (clock_gettime(CLOCK_BOOTTIME, &ts) == 0) return ts.tv_sec;
+#endif
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+static void ticket_mac(uid_t uid, unsigned long expiry, uint64_t nonce,
+        const char *hash, char mac_hex[2 * SHA256_DIGEST_SIZE + 1]) {
+    uint8_t mac[SHA256_DIGEST_SIZE];
+    hmac_sha256_ctx hmac;
+    char head[64];
+    int i, len;
+
+    len = snprintf(head, sizeof(head), "%lu:%lx:%016" PRIx64 ":",
+            (unsigned long) uid, expiry, nonce);
+
+    hmac_sha256_init(&hmac, ticket_key, sizeof(ticket_key));
+    hmac_sha256_update(&hmac, head, len);
+    hmac_sha256_update(&hmac, hash, strlen(hash));
+    hmac_sha256_final(&hmac, mac);
+
+    for (i = 0; i < SHA256_DIGEST_SIZE; i++) {
+        sprintf(mac_hex + 2 * i, "%02x", mac[i]);
+    }
+}
+
+void ticket_init(int lifetime) {
+    ticket_lifetime = lifetime;
+    dev_urandom_buf(ticket_key, sizeof(ticket_key));
+}
+
+int ticket_issue(uid_t uid, const char *hash, char *buf, size_t size) {
+    char mac_hex[2 * SHA256_DIGEST_SIZE + 1];
+    unsigned long expiry;
+    uint64_t nonce;
+    int ret;
+
+    if (ticket_lifetime <= 0) return -1;
+
+    expiry = now() + ticket_lifetime;
+    dev_urandom_buf((uint8_t *) &nonce, sizeof(nonce));
+    ticket_mac(uid, expiry, nonce, hash, mac_hex);
+
+    ret = snprintf(buf, size, "%lx.%016" PRIx64 ".%s", expiry, nonce, mac_hex);
+    if (ret < 0 || (size_t) ret >= size) return -1;
+    return 0;
+}
+
+int ticket_check(const char *ticket, uid_t uid, const char *hash) {
+    char mac_hex[2 * SHA256_DIGEST_SIZE + 1], given[2 * SHA256_DIGEST_SIZE + 1];
+    unsigned long expiry;
+    uint64_t nonce;
+    int i, diff = 0, len;
+
+    if (ticket_lifetime <= 0) return -1;
+
+    if (sscanf(ticket, "%lx.%" SCNx64 ".%64[0-9a-f]%n",
+                &expiry, &nonce, given, &len) != 3) {
+        return -1;
+    }
+    if (ticket[len] != '\0' || strlen(given) != 2 * SHA256_DIGEST_SIZE) {
+        return -1;
+    }
+
+    ticket_mac(uid, expiry, nonce, hash, mac_hex);
+
+    // Don't give away how much of the MAC was right
+    for (i = 0; i < 2 * SHA256_DIGEST_SIZE; i++) {
+        diff |= mac_hex[i] ^ given[i];
+    }
+    if (diff) return -1;
+
+    // Also reject expiries further out than we ever issue
+    if (expiry < now() || expiry > now() + ticket_lifetime) return -1;
+    return 0;
+}
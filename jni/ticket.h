@@ -0,0 +1,44 @@
+/*
+ * Copyright 2013, Tan Chee Eng (@tan-ce)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+/**
+ * Session tickets, so that a client which authenticated recently
+ * can skip the bcrypt. A ticket is only good for the uid it was
+ * issued to, and only while the password stays the same.
+ */
+
+#ifndef _TICKET_H_
+#define _TICKET_H_
+
+#include <stddef.h>
+#include <sys/types.h>
+
+// Room needed for a ticket, including the NUL
+#define TICKET_SPACE    100
+
+// Picks the signing key. Tickets are valid for lifetime seconds.
+// Tickets from before a restart are rejected.
+void ticket_init(int lifetime);
+
+// Writes a ticket for uid, tied to the current password hash
+// Returns 0 on success, -1 on failure
+int ticket_issue(uid_t uid, const char *hash, char *buf, size_t size);
+
+// Returns 0 if ticket was issued to uid for hash and hasn't expired
+int ticket_check(const char *ticket, uid_t uid, const char *hash);
+
+#endif
@@ -0,0 +1,167 @@
+/*
+ * Copyright 2013, Tan Chee Eng (@tan-ce)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * Minimal io_uring
+ *
+ * The ring is used from one thread, so the only ordering needed is
+ * against the kernel: the SQ tail is published with a release store
+ * after the entries are filled in, and the CQ tail read with an
+ * acquire load before the entries are.
+ */
+
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+
+#include "uring.h"
+
+#ifdef HAVE_URING
+
+static int sys_setup(unsigned entries, struct io_uring_params *p) {
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_enter(int fd, unsigned submit, unsigned wait, unsigned flags) {
+    return syscall(__NR_io_uring_enter, fd, submit, wait, flags, NULL, 0);
+}
+
+static int sys_register(int fd, unsigned op, const void *arg, unsigned n) {
+    return syscall(__NR_io_uring_register, fd, op, arg, n);
+}
+
+int uring_init(struct uring *u, unsigned entries) {
+    struct io_uring_params p;
+    char *sq, *cq;
+    int saved;
+
+    memset(u, '\0', sizeof(*u));
+    memset(&p, '\0', sizeof(p));
+
+    u->fd = sys_setup(entries, &p);
+    if (u->fd < 0) return -1;
+    u->features = p.features;
+
+    u->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    u->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    // Newer kernels map both rings at once
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (u->cq_ring_size > u->sq_ring_size) u->sq_ring_size = u->cq_ring_size;
+        u->cq_ring_size = u->sq_ring_size;
+    }
+
+    u->sq_ring = mmap(NULL, u->sq_ring_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    if (u->sq_ring == MAP_FAILED) goto fail;
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        u->cq_ring = u->sq_ring;
+    } else {
+        u->cq_ring = mmap(NULL, u->cq_ring_size, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+        if (u->cq_ring == MAP_FAILED) goto fail;
+    }
+
+    u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED) goto fail;
+
+    sq = u->sq_ring;
+    u->sq_head = (unsigned *) (sq + p.sq_off.head);
+    u->sq_tail = (unsigned *) (sq + p.sq_off.tail);
+    u->sq_mask = (unsigned *) (sq + p.sq_off.ring_mask);
+    u->sq_array = (unsigned *) (sq + p.sq_off.array);
+
+    cq = u->cq_ring;
+    u->cq_head = (unsigned *) (cq + p.cq_off.head);
+    u->cq_tail = (unsigned *) (cq + p.cq_off.tail);
+    u->cq_mask = (unsigned *) (cq + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+
+    return 0;
+
+fail:
+    saved = errno;
+    uring_free(u);
+    errno = saved;
+    return -1;
+}
+
+void uring_free(struct uring *u) {
+    if (u->sqes && u->sqes != MAP_FAILED) munmap(u->sqes, u->sqes_size);
+    if (u->cq_ring && u->cq_ring != MAP_FAILED && u->cq_ring != u->sq_ring) {
+        munmap(u->cq_ring, u->cq_ring_size);
+    }
+    if (u->sq_ring && u->sq_ring != MAP_FAILED) munmap(u->sq_ring, u->sq_ring_size);
+    if (u->fd >= 0) close(u->fd);
+    memset(u, '\0', sizeof(*u));
+    u->fd = -1;
+}
+
+int uring_register_buffers(struct uring *u, const struct iovec *iov,
+        unsigned n) {
+    return sys_register(u->fd, IORING_REGISTER_BUFFERS, iov, n) < 0 ? -1 : 0;
+}
+
+struct io_uring_sqe *uring_sqe(struct uring *u) {
+    unsigned head, tail, index;
+    struct io_uring_sqe *sqe;
+
+    head = __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+    tail = *u->sq_tail + u->sq_pending;
+    if (tail - head > *u->sq_mask) return NULL;
+
+    index = tail & *u->sq_mask;
+    sqe = &u->sqes[index];
+    memset(sqe, '\0', sizeof(*sqe));
+    u->sq_array[index] = index;
+    u->sq_pending++;
+    return sqe;
+}
+
+int uring_submit(struct uring *u, unsigned wait) {
+    unsigned submit;
+    int ret;
+
+    if (u->sq_pending) {
+        __atomic_store_n(u->sq_tail, *u->sq_tail + u->sq_pending,
+                __ATOMIC_RELEASE);
+        u->sq_pending = 0;
+    }
+
+    // Including any an interrupted call didn't get to
+    submit = *u->sq_tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+    ret = sys_enter(u->fd, submit, wait, wait ? IORING_ENTER_GETEVENTS : 0);
+    return ret < 0 ? -1 : 0;
+}
+
+struct io_uring_cqe *uring_cqe(struct uring *u) {
+    unsigned head = *u->cq_head;
+
+    if (head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) return NULL;
+    return &u->cqes[head & *u->cq_mask];
+}
+
+void uring_seen(struct uring *u) {
+    __atomic_store_n(u->cq_head, *u->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+#endif
@@ -0,0 +1,81 @@
+/*
+ * Copyright 2013, Tan Chee Eng (@tan-ce)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * Just enough io_uring to relay with, on the raw system calls.
+ * HAVE_URING is defined when the kernel headers know about it.
+ */
+
+#ifndef _URING_H_
+#define _URING_H_
+
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#ifdef __NR_io_uring_setup
+#define HAVE_URING
+#endif
+#endif
+#endif
+
+#ifdef HAVE_URING
+
+#include <sys/uio.h>
+
+struct uring {
+    int fd;
+    unsigned features;          // IORING_FEAT_*
+
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned sq_pending;        // Filled in but not submitted yet
+
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size, sqes_size;
+};
+
+// Sets up a ring with room for entries submissions
+// Returns -1 if the kernel won't, with errno set
+int uring_init(struct uring *u, unsigned entries);
+
+void uring_free(struct uring *u);
+
+// Registers n buffers, for the *_FIXED operations with buf_index
+// Returns -1 on failure, with errno set
+int uring_register_buffers(struct uring *u, const struct iovec *iov,
+        unsigned n);
+
+// Returns a cleared submission entry, or NULL if the ring is full
+struct io_uring_sqe *uring_sqe(struct uring *u);
+
+// Submits what's been filled in, and waits for at least wait
+// completions
+// Returns -1 on failure, with errno set
+int uring_submit(struct uring *u, unsigned wait);
+
+// Returns the next completion, or NULL if there's none. Pass it to
+// uring_seen() once done with it.
+struct io_uring_cqe *uring_cqe(struct uring *u);
+
+void uring_seen(struct uring *u);
+
+#endif
+
+#endif
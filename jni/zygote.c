@@ -0,0 +1,427 @@
+/*
+ * Copyright 2013, Tan Chee Eng (@tan-ce)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * Warm sessions
+ *
+ * Each command given with -z has pools of sessions which were
+ * started on PTYs of our own and are sitting at their prompt. A
+ * launch of exactly that command takes one, and the pool is topped
+ * up again from the event loop, one session per pass so that other
+ * clients are served in between.
+ *
+ * A session runs with the environment additions and in the directory
+ * its launch would have given it, so each combination of those has a
+ * pool of its own (a target). The first launch for a target is done
+ * the usual way and starts its pool, replacing the target asked for
+ * least recently when a command has ZYGOTE_TARGETS of them already.
+ *
+ * Sessions which end while parked are dropped when they're reaped,
+ * so the pools are only looked at again after a take or a reap. A
+ * target whose sessions fail to start is retried with a growing
+ * delay, unless the command can't be run there at all.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <termios.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+
+#include "helpers.h"
+#include "ptypool.h"
+#include "zygote.h"
+
+pid_t pts_spawn(int pts_fd, char **cmd_argv, char **env, int cwd_fd,
+        const struct termios *tio, const struct winsize *ws,
+        const char **failed);
+
+// Targets kept warm per command
+#define ZYGOTE_TARGETS  4
+
+// Delay before retrying a target after a failed start, in ms. It's
+// doubled on every failure in a row.
+#define RETRY_MIN_DELAY 1000
+#define RETRY_MAX_DELAY 60000
+
+// A session waiting for a client
+struct zygote {
+    pid_t pid;
+    int ptm;
+};
+
+// Sessions started with the same environment additions, in the
+// same directory
+struct zygote_target {
+    char **env;
+    int cwd_fd;
+    dev_t cwd_dev;
+    ino_t cwd_ino;
+    unsigned long used;     // When last asked for, in launches
+
+    struct zygote *parked;
+    int num_parked;
+    int broken;             // Can't be run there, don't retry
+    int64_t retry_at;       // After a failed start, on now_ms()'s clock
+    int64_t retry_delay;    // Since the last failure, or 0
+};
+
+struct zygote_pool {
+    struct zygote_pool *next;
+    char *cmd;              // argv points into this
+    char **argv;
+    int count;              // Sessions to keep warm per target
+
+    struct zygote_target targets[ZYGOTE_TARGETS];
+    int num_targets;
+};
+
+static struct zygote_pool *pools = NULL;
+static unsigned long launches = 0;
+static int dirty = 1;       // Some target is short of sessions
+
+// Identifies the directory cwd_fd, or ours if it's -1
+static int dir_id(int cwd_fd, dev_t *dev, ino_t *ino) {
+    struct stat st;
+
+    if ((cwd_fd >= 0 ? fstat(cwd_fd, &st) : stat(".", &st)) < 0) return -1;
+    *dev = st.st_dev;
+    *ino = st.st_ino;
+    return 0;
+}
+
+static int same_strings(char **a, char **b) {
+    static char *none[] = { NULL };
+
+    if (!a) a = none;
+    if (!b) b = none;
+    for (; *a && *b; a++, b++) {
+        if (strcmp(*a, *b) != 0) return 0;
+    }
+    return !*a && !*b;
+}
+
+// A copy of a NULL terminated array of strings, in one allocation
+static char **copy_strings(char **src) {
+    size_t n, size = 0;
+    char **dst, *p;
+
+    for (n = 0; src && src[n]; n++) size += strlen(src[n]) + 1;
+
+    dst = malloc((n + 1) * sizeof(*dst) + size);
+    if (!dst) return NULL;
+
+    p = (char *) (dst + n + 1);
+    for (n = 0; src && src[n]; n++) {
+        dst[n] = strcpy(p, src[n]);
+        p += strlen(p) + 1;
+    }
+    dst[n] = NULL;
+    return dst;
+}
+
+// Ends a parked session. Losing its terminal is enough for a
+// shell, the SIGKILL is for anything else.
+static void zygote_kill(struct zygote *z) {
+    close(z->ptm);
+    kill(z->pid, SIGKILL);
+}
+
+// Whether the parked session is still there
+static int zygote_alive(struct zygote *z) {
+    struct pollfd pfd;
+
+    pfd.fd = z->ptm;
+    pfd.events = 0;
+    if (poll(&pfd, 1, 0) < 0) return 1;
+    return !(pfd.revents & (POLLHUP | POLLERR));
+}
+
+// Kills a target's sessions and forgets what they were started with
+static void target_clear(struct zygote_target *t) {
+    while (t->num_parked) zygote_kill(&t->parked[--t->num_parked]);
+    free(t->env);
+    t->env = NULL;
+    if (t->cwd_fd >= 0) close(t->cwd_fd);
+    t->cwd_fd = -1;
+}
+
+// Adds a target for sessions started with env, in the directory
+// cwd_fd (-1 for ours), which is dev and ino. The one asked for least
+// recently makes way when there's no room.
+static void target_add(struct zygote_pool *pool, char **env, int cwd_fd,
+        dev_t dev, ino_t ino) {
+    struct zygote_target *t;
+    char **env_copy = NULL;
+    int i, fd = -1;
+
+    if (env && !(env_copy = copy_strings(env))) return;
+    if (cwd_fd >= 0 && (fd = fcntl(cwd_fd, F_DUPFD_CLOEXEC, 0)) < 0) {
+        free(env_copy);
+        return;
+    }
+
+    if (pool->num_targets < ZYGOTE_TARGETS) {
+        t = &pool->targets[pool->num_targets];
+        t->parked = calloc(pool->count, sizeof(*t->parked));
+        if (!t->parked) {
+            free(env_copy);
+            if (fd >= 0) close(fd);
+            return;
+        }
+        pool->num_targets++;
+    } else {
+        t = &pool->targets[0];
+        for (i = 1; i < pool->num_targets; i++) {
+            if (pool->targets[i].used < t->used) t = &pool->targets[i];
+        }
+        target_clear(t);
+    }
+
+    t->env = env_copy;
+    t->cwd_fd = fd;
+    t->cwd_dev = dev;
+    t->cwd_ino = ino;
+    t->used = ++launches;
+    t->broken = 0;
+    t->retry_at = 0;
+    t->retry_delay = 0;
+    dirty = 1;
+}
+
+// The pool's target for env and the directory dev and ino, or NULL
+static struct zygote_target *target_find(struct zygote_pool *pool,
+        char **env, dev_t dev, ino_t ino) {
+    struct zygote_target *t;
+    int i;
+
+    for (i = 0; i < pool->num_targets; i++) {
+        t = &pool->targets[i];
+        if (t->cwd_dev == dev && t->cwd_ino == ino &&
+                same_strings(t->env, env)) {
+            return t;
+        }
+    }
+    return NULL;
+}
+
+// Keeps sessions warm as given by a -z option, "<count>:<command>"
+// where the command's arguments are separated by spaces
+// Returns -1 if the spec is malformed
+int zygote_config(const char *spec) {
+    struct zygote_pool *pool;
+    char *end, *arg;
+    int count, argc;
+    dev_t dev;
+    ino_t ino;
+
+    count = strtol(spec, &end, 10);
+    if (end == spec || *end != ':' || count <= 0 || end[1] != '/') return -1;
+
+    pool = calloc(1, sizeof(*pool));
+    if (!pool) return -1;
+    pool->cmd = strdup(end + 1);
+    pool->argv = calloc(strlen(end + 1) / 2 + 2, sizeof(*pool->argv));
+    if (!pool->cmd || !pool->argv) {
+        free(pool->cmd);
+        free(pool->argv);
+        free(pool);
+        return -1;
+    }
+
+    argc = 0;
+    for (arg = strtok(pool->cmd, " "); arg; arg = strtok(NULL, " ")) {
+        pool->argv[argc++] = arg;
+    }
+    pool->count = count;
+
+    // To begin with, sessions like the daemon's own
+    if (dir_id(-1, &dev, &ino) == 0) target_add(pool, NULL, -1, dev, ino);
+    if (!pool->num_targets) {
+        free(pool->cmd);
+        free(pool->argv);
+        free(pool);
+        return -1;
+    }
+
+    pool->next = pools;
+    pools = pool;
+    return 0;
+}
+
+// Starts one session for the target
+// Returns -1 on failure, with errno set
+static int zygote_start(struct zygote_pool *pool, struct zygote_target *t) {
+    struct zygote *z = &t->parked[t->num_parked];
+    const char *failed = NULL;
+    int pts, err;
+
+    z->ptm = ptypool_take(&pts);
+    if (z->ptm < 0) {
+        err = errno;
+        perror("zygote: Unable to open a PTY");
+        errno = err;
+        return -1;
+    }
+
+    z->pid = pts_spawn(pts, pool->argv, t->env, t->cwd_fd,
+            NULL, NULL, &failed);
+    err = errno;
+    close(pts);
+    if (z->pid == -1) {
+        printf("zygote: %s: %s: %s\n", pool->argv[0],
+                failed ? failed : "Unable to start", strerror(err));
+        close(z->ptm);
+        errno = err;
+        return -1;
+    }
+
+    t->num_parked++;
+    return 0;
+}
+
+// Schedules the target's next try after a failed start, or gives up
+// on it when the command itself is missing or can't be run there
+static void target_failed(struct zygote_pool *pool, struct zygote_target *t,
+        int err, int64_t now) {
+    if (err == ENOENT || err == ENOTDIR || err == EACCES || err == ENOEXEC) {
+        t->broken = 1;
+        return;
+    }
+
+    t->retry_delay *= 2;
+    if (t->retry_delay < RETRY_MIN_DELAY) t->retry_delay = RETRY_MIN_DELAY;
+    if (t->retry_delay > RETRY_MAX_DELAY) t->retry_delay = RETRY_MAX_DELAY;
+    t->retry_at = now + t->retry_delay;
+    printf("zygote: %s: Retrying in %lld ms\n", pool->argv[0],
+            (long long) t->retry_delay);
+}
+
+// Starts a session for the target which is furthest short of its
+// count, one per call so that a client is never kept waiting behind
+// a row of them. Call from the event loop. Does nothing unless a
+// session was taken or has ended.
+// Returns 0 if there are more to start, the milliseconds until a
+// target is due to be retried, or -1. The caller waits no longer
+// before calling again.
+int zygote_fill(void) {
+    struct zygote_target *t, *next = NULL;
+    struct zygote_pool *pool, *next_pool = NULL;
+    int64_t now, wait = -1;
+    int j;
+
+    if (!dirty) return -1;
+    dirty = 0;
+    now = now_ms();
+
+    for (pool = pools; pool; pool = pool->next) {
+        for (j = 0; j < pool->num_targets; j++) {
+            t = &pool->targets[j];
+            if (t->broken || t->num_parked >= pool->count) continue;
+
+            dirty = 1;
+            if (t->retry_at > now) {
+                if (wait < 0 || t->retry_at - now < wait) {
+                    wait = t->retry_at - now;
+                }
+            } else if (!next || t->num_parked < next->num_parked) {
+                next = t;
+                next_pool = pool;
+            }
+        }
+    }
+    if (!next) return wait;
+
+    if (zygote_start(next_pool, next) < 0) {
+        target_failed(next_pool, next, errno, now);
+    } else {
+        next->retry_delay = 0;
+    }
+    return 0;
+}
+
+// Hands over a warm session for argv, if there is one which was
+// started with the same environment additions and directory. ws (if
+// not NULL) is applied to it. The terminal settings are left alone,
+// the shell has set them up by now and a change would race its line
+// editor. A launch which finds no such sessions has some started for
+// next time.
+// Returns the PTY master, with the session's PID in *pid, or -1.
+int zygote_take(char **argv, char **env, int cwd_fd,
+        const struct winsize *ws, pid_t *pid) {
+    struct zygote_target *t;
+    struct zygote_pool *pool;
+    struct zygote *z;
+    dev_t dev;
+    ino_t ino;
+
+    for (pool = pools; pool; pool = pool->next) {
+        if (same_strings(pool->argv, argv)) break;
+    }
+    if (!pool || dir_id(cwd_fd, &dev, &ino) < 0) return -1;
+
+    t = target_find(pool, env, dev, ino);
+    if (!t) {
+        target_add(pool, env, cwd_fd, dev, ino);
+        return -1;
+    }
+    t->used = ++launches;
+
+    while (t->num_parked) {
+        z = &t->parked[--t->num_parked];
+        dirty = 1;
+        if (!zygote_alive(z)) {
+            zygote_kill(z);
+            continue;
+        }
+
+        if (ws && ioctl(z->ptm, TIOCSWINSZ, ws) < 0) {
+            perror("zygote: Unable to set window size");
+        }
+
+        *pid = z->pid;
+        return z->ptm;
+    }
+
+    return -1;
+}
+
+// Drops the parked session pid, which has ended and been reaped, so
+// that zygote_fill() replaces it. Call for every child reaped.
+void zygote_reaped(pid_t pid) {
+    struct zygote_target *t;
+    struct zygote_pool *pool;
+    int i, j;
+
+    for (pool = pools; pool; pool = pool->next) {
+        for (j = 0; j < pool->num_targets; j++) {
+            t = &pool->targets[j];
+            for (i = 0; i < t->num_parked; i++) {
+                if (t->parked[i].pid != pid) continue;
+                close(t->parked[i].ptm);
+                t->parked[i] = t->parked[--t->num_parked];
+                dirty = 1;
+                return;
+            }
+        }
+    }
+}
@@ -0,0 +1,56 @@
+/*
+ * Copyright 2013, Tan Chee Eng (@tan-ce)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * Warm sessions: commands (usually shells) started ahead of time on
+ * PTYs of the daemon's own, so that a launch only has to hand over
+ * the PTY master.
+ */
+
+#ifndef _ZYGOTE_H_
+#define _ZYGOTE_H_
+
+#include <sys/types.h>
+#include <sys/ioctl.h>
+
+// Keeps sessions warm as given by a -z option, "<count>:<command>"
+// where the command's arguments are separated by spaces
+// Returns -1 if the spec is malformed
+int zygote_config(const char *spec);
+
+// Starts a session for a target which is short of its count, one
+// per call. Call from the event loop. Does nothing unless a session
+// was taken or has ended.
+// Returns 0 if there are more to start, the milliseconds until a
+// target is due to be retried, or -1. The caller waits no longer
+// before calling again.
+int zygote_fill(void);
+
+// Drops the parked session pid, which has ended and been reaped, so
+// that zygote_fill() replaces it. Call for every child reaped.
+void zygote_reaped(pid_t pid);
+
+// Hands over a warm session for argv, if there is one which was
+// started with the same environment additions and directory. ws (if
+// not NULL) is applied to it. The terminal settings are left alone,
+// the shell has set them up by now and a change would race its line
+// editor. A launch which finds no such sessions has some started for
+// next time.
+// Returns the PTY master, with the session's PID in *pid, or -1.
+int zygote_take(char **argv, char **env, int cwd_fd,
+        const struct winsize *ws, pid_t *pid);
+
+#endif